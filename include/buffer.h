@@ -4,6 +4,9 @@
 #include <stddef.h>
 #include "config.h"
 
+// Elements of a buffer once it allocates, its capacity doubles when full
+#define BUFFER_MIN_CAPACITY 16
+
 #define buffer_foreach(b, t, it) for (t* it = (b).data; it != (b).data + ((b).size * (b).element_size); ++it)
 
 typedef struct buffer {
@@ -13,6 +16,7 @@ typedef struct buffer {
 
 buffer_t buffer_new(size_t element_size);
 void buffer_free(buffer_t* buf);
+// Returns false if the buffer was full and could not grow
 bool buffer_push(buffer_t* buf, void* element);
 void* buffer_at(buffer_t* buf, size_t index);
 void* buffer_last(buffer_t* buf);
@@ -52,16 +52,16 @@ typedef struct ast_node {
 		} function;
 		struct {
 			token_t token;
-			identifier_t* id;
+			const char* name;
 		} identifier;
 		struct {
 			token_type_t type;
-			literal_t* lit;
+			literal_t lit;
 		} literal;
 		struct {
 			token_type_t operator;
 			struct ast_node* lhs;
-			identifier_t* name;
+			const char* name;
 		} property;
 		struct {
 			struct ast_node* expression;
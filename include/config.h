@@ -13,6 +13,82 @@
 	#define FREE(ptr) free(ptr)
 #endif
 
+#ifndef REALLOC
+	#define REALLOC(ptr, size) realloc(ptr, size)
+#endif
+
+// Dispatch the interpreter through a table of label addresses instead of a
+// switch statement. Requires the GNU "labels as values" extension.
+#ifndef USE_COMPUTED_GOTO
+	#if defined(__GNUC__) || defined(__clang__)
+		#define USE_COMPUTED_GOTO 1
+	#else
+		#define USE_COMPUTED_GOTO 0
+	#endif
+#endif
+
+// Translate hot functions to machine code, only x86-64 Linux is supported
+#ifndef USE_JIT
+	#if defined(__x86_64__) && defined(__linux__)
+		#define USE_JIT 1
+	#else
+		#define USE_JIT 0
+	#endif
+#endif
+
+// Number of calls after which a function is translated, 0 disables the JIT
+#ifndef JIT_THRESHOLD
+	#define JIT_THRESHOLD 100
+#endif
+
+// Bytes of objects allocated before the first collection, and the least the
+// heap is allowed to grow to after any of them
+#ifndef GC_THRESHOLD
+	#define GC_THRESHOLD (1024 * 1024)
+#endif
+
+// After a collection, the next one runs once the heap is this many times larger
+#define GC_GROWTH_FACTOR 2
+
+// Bytes of young objects allocated before a minor collection, which only
+// traces and sweeps them. 0 leaves them to major collections.
+#ifndef GC_NURSERY_SIZE
+	#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Objects marked or swept per allocation while a cycle runs, 0 stops the world
+// for whole cycles instead
+#ifndef GC_STEP_WORK
+	#define GC_STEP_WORK 0
+#endif
+
+// Threads helping with marking during stop-the-world collections, on top of
+// the collecting one
+#ifndef GC_MARK_THREADS
+	#define GC_MARK_THREADS 0
+#endif
+
+// Most bytes objects and the storage of arrays and tables may take while a
+// function runs, 0 for no limit
+#ifndef GC_HEAP_LIMIT
+	#define GC_HEAP_LIMIT 0
+#endif
+
+// Percentage of the heap's slabs compaction must be able to release to run
+// whenever the VM is not running any function, 0 disables it
+#ifndef GC_COMPACT_RATIO
+	#define GC_COMPACT_RATIO 0
+#endif
+
+// Initial number of values on the VM stack, it doubles whenever a frame needs more
+#define STACK_CAPACITY 1024
+
+// Maximum depth of nested calls before raising a "stack overflow" error
+#define CALL_STACK_DEPTH 4096
+
+// Number of receiver classes remembered by each property access
+#define INLINE_CACHE_SIZE 4
+
 #define STRING_POOL_CAPACITY 32
 
 #define TABLE_CAPACITY 16
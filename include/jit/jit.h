@@ -0,0 +1,53 @@
+#pragma once
+
+#include "vm.h"
+
+// Baseline JIT: translates the stack bytecode of hot functions to machine code
+// stitched together from per-instruction templates. Complex instructions call
+// back into the runtime, the interpreter runs everything that is not (yet)
+// translated.
+
+bool jit_compile(vm_t* vm, function_t* fn);
+void jit_free(function_t* fn);
+
+// Run the frame `f` through its function's machine code until it returns.
+// Returns false on error, leaving the frames for the caller to drop.
+bool jit_enter(vm_t* vm, frame_t* f);
+
+// Called from machine code to run the instruction at `start`, prefixes
+// included, that has no template, or the slow path of one that does. Returns
+// false on error.
+bool jit_execute(vm_t* vm, frame_t* f, uint8_t* start);
+
+// Called from machine code to call the value on top of the stack with the
+// `argc` arguments below it. Returns false on error.
+bool jit_call(vm_t* vm, uint8_t argc);
+
+// What machine code returns to `jit_enter`: whether it failed, returned, or
+// replaced its frame by the one of a tail callee that is left to run.
+typedef enum jit_status {
+	JIT_ERROR,
+	JIT_RETURNED,
+	JIT_TAIL_CALLED,
+} jit_status_t;
+
+// Called from machine code to tail call the value on top of the stack with the
+// `argc` arguments below it.
+jit_status_t jit_tail_call(vm_t* vm, uint8_t argc);
+
+// Whether `fn` has machine code, translating it once it has been called often
+// enough.
+static inline bool jit_ready(vm_t* vm, function_t* fn)
+{
+#if USE_JIT
+	if (fn->compiled.jit)
+		return true;
+	if (vm->jit_threshold == 0 || ++fn->compiled.calls != vm->jit_threshold)
+		return false;
+	return jit_compile(vm, fn);
+#else
+	(void)vm;
+	(void)fn;
+	return false;
+#endif
+}
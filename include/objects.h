@@ -32,6 +32,8 @@ typedef enum object_type {
 	OBJECT_TABLE,
 } object_type_t;
 
+#define OBJECT_TYPE_COUNT (OBJECT_TABLE + 1)
+
 typedef int8_t (*native_fn_t)(vm_t* vm, uint8_t argc);
 
 // -----------------------------------------------------------------------------
@@ -40,24 +42,31 @@ typedef struct class class_t;
 
 typedef struct object {
 	object_type_t type;
-	bool gc_bit;
+	// Old object in `vm->gc_remembered`
+	bool gc_remembered;
 
 	class_t* class;
 
-	// Linked list of objects on the heap
+	// Linked list of young objects, old ones are only found through the
+	// allocator
 	struct object* next;
 } object_t;
 
+size_t object_size(object_t* obj);
+size_t object_buffers_size(object_t* obj);
+
 // -----------------------------------------------------------------------------
 
 typedef struct array {
 	object_t header;
-	buffer_t values;
+	value_vector_t values;
 } array_t;
 
 array_t* new_array(vm_t* vm);
-array_t* new_array_from(vm_t* vm, buffer_t* values);
-void free_array(array_t* array);
+array_t* new_array_from(vm_t* vm, value_t* values, size_t count);
+void array_reserve(vm_t* vm, array_t* array, size_t capacity);
+void array_push(vm_t* vm, array_t* array, value_t value);
+void finalize_array(array_t* array);
 
 // -----------------------------------------------------------------------------
 
@@ -70,11 +79,22 @@ typedef struct string {
 
 string_t* new_string(vm_t* vm, const char* str);
 string_t* new_string_length(vm_t* vm, const char* str, size_t length);
-void free_string(string_t* string);
 bool string_compare(string_t* a, string_t* b);
 
 // -----------------------------------------------------------------------------
 
+// Per-instruction cache of property lookups. Entries are keyed on the class
+// of the receiver and on the version of the class' properties table, so any
+// change to the table invalidates them.
+typedef struct inline_cache {
+	struct {
+		class_t* class;
+		uint32_t version;
+		value_t value;
+	} entries[INLINE_CACHE_SIZE];
+	uint8_t victim;
+} inline_cache_t;
+
 typedef enum function_type {
 	FUNCTION_COMPILED,
 	FUNCTION_NATIVE,
@@ -87,9 +107,20 @@ typedef struct function {
 	union {
 		struct {
 			buffer_t code;
-			buffer_t constants;
+			value_vector_t constants;
 			// All functions are closures.
-			buffer_t captures;
+			value_vector_t captures;
+			// One inline cache per property access
+			buffer_t caches;
+			// Upper bound of the values this function pushes on the stack, or
+			// its register count
+			size_t max_stack;
+			// Code is made of `reg_op_t` instead of byte code
+			bool registers;
+			// Machine code, see src/jit/jit.c
+			void* jit;
+			size_t jit_size;
+			uint32_t calls;
 		} compiled;
 		native_fn_t native;
 	};
@@ -97,7 +128,7 @@ typedef struct function {
 
 function_t* new_function(vm_t* vm, uint8_t arity);
 function_t* new_native_function(vm_t* vm, native_fn_t fn, uint8_t arity);
-void free_function(function_t* fn);
+void finalize_function(function_t* fn);
 
 // -----------------------------------------------------------------------------
 
@@ -106,16 +137,33 @@ typedef struct table_pair {
 	value_t value;
 } table_pair_t;
 
+DEFINE_VECTOR(pair_vector, table_pair_t)
+
+// References a weak table holds do not keep objects alive: the pairs whose weak
+// key or value is collected are removed. A value with a weak key is only kept
+// alive by the key, if the values are not weak too. Strings are not weak, as
+// the same one can be made again.
+typedef enum table_mode {
+	TABLE_STRONG = 0,
+	TABLE_WEAK_KEYS = 1 << 0,
+	TABLE_WEAK_VALUES = 1 << 1,
+} table_mode_t;
+
 typedef struct table {
 	object_t header;
-	buffer_t buckets[TABLE_CAPACITY];
+	// Bumped on every write, see `inline_cache_t`
+	uint32_t version;
+	uint8_t mode;
+	pair_vector_t buckets[TABLE_CAPACITY];
 } table_t;
 
 table_t* new_table(vm_t* vm);
-void free_table(table_t* table);
+table_t* new_weak_table(vm_t* vm, table_mode_t mode);
+void finalize_table(vm_t* vm, table_t* table);
 value_t table_get(table_t* table, value_t key);
-void table_set(table_t* table, value_t key, value_t value);
-void table_remove(table_t* table, value_t key);
+void table_set(vm_t* vm, table_t* table, value_t key, value_t value);
+void table_remove(vm_t* vm, table_t* table, value_t key);
+void table_rehash(vm_t* vm, table_t* table);
 
 // -----------------------------------------------------------------------------
 
@@ -137,12 +185,12 @@ struct class {
 	object_t header;
 	string_t* name;
 	struct class* super;
-	buffer_t constants;
+	value_vector_t constants;
 	table_t* properties;
 };
 
 class_t* new_class(vm_t* vm, class_t* super, string_t* name);
-void free_class(class_t* class);
+void finalize_class(class_t* class);
 
 // -----------------------------------------------------------------------------
 
@@ -2,7 +2,9 @@
 
 #include "vm.h"
 
-#define DEFINE_METHOD(class, name, fn, arity) table_set(class->properties, VALUE_OBJECT(new_string(vm, name)), VALUE_OBJECT(new_native_function(vm, fn, arity)));
+#define DEFINE_METHOD(class, name, fn, arity) vm_define_native(vm, class->properties, name, fn, arity);
+
+void vm_define_native(vm_t* vm, table_t* table, const char* name, native_fn_t fn, uint8_t arity);
 
 void vm_std_all(vm_t* vm);
 
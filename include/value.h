@@ -2,9 +2,12 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include "vector.h"
 
 typedef uint64_t value_t;
 
+DEFINE_VECTOR(value_vector, value_t)
+
 // IEEE 756 DOUBLE     S[Exponent-][Mantissa------------------------------------------]
 #define SIGN_BIT    (0b1000000000000000000000000000000000000000000000000000000000000000)
 #define EXPONENT    (0b0111111111110000000000000000000000000000000000000000000000000000)
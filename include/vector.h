@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include "config.h"
+
+// Growable arrays of one type, declared with `DEFINE_VECTOR(name, type)`.
+// Unlike `buffer_t`, elements are accessed without a runtime element size and
+// the capacity doubles, so pushing N elements copies O(N) of them. A zeroed
+// vector is empty.
+
+#define VECTOR_MIN_CAPACITY 8
+
+#define vector_foreach(v, it) for (__typeof__((v).data) it = (v).data; it != (v).data + (v).size; ++it)
+
+// Capacity a vector grows to so it holds at least `needed` elements
+static inline size_t vector_grown_capacity(size_t capacity, size_t needed)
+{
+	size_t grown = capacity > 0 ? capacity * 2 : VECTOR_MIN_CAPACITY;
+	return grown < needed ? needed : grown;
+}
+
+#define DEFINE_VECTOR(name, type) \
+	typedef struct name { \
+		type* data; \
+		size_t size, capacity; \
+	} name##_t; \
+	\
+	static inline void name##_free(name##_t* v) \
+	{ \
+		FREE(v->data); \
+		v->data = NULL; \
+		v->size = v->capacity = 0; \
+	} \
+	\
+	/* Returns false if it could not allocate */ \
+	static inline bool name##_reserve(name##_t* v, size_t capacity) \
+	{ \
+		if (capacity <= v->capacity) \
+			return true; \
+		type* data = REALLOC(v->data, capacity * sizeof(type)); \
+		if (!data) \
+			return false; \
+		v->data = data; \
+		v->capacity = capacity; \
+		return true; \
+	} \
+	\
+	/* New elements are zeroed, returns false if it could not allocate */ \
+	static inline bool name##_resize(name##_t* v, size_t size) \
+	{ \
+		if (size > v->capacity && !name##_reserve(v, vector_grown_capacity(v->capacity, size))) \
+			return false; \
+		if (size > v->size) \
+			memset(v->data + v->size, 0, (size - v->size) * sizeof(type)); \
+		v->size = size; \
+		return true; \
+	} \
+	\
+	/* Returns false if it could not allocate */ \
+	static inline bool name##_push(name##_t* v, type element) \
+	{ \
+		if (v->size == v->capacity && !name##_reserve(v, vector_grown_capacity(v->capacity, v->size + 1))) \
+			return false; \
+		v->data[v->size++] = element; \
+		return true; \
+	} \
+	\
+	static inline void name##_remove(name##_t* v, size_t index) \
+	{ \
+		memmove(v->data + index, v->data + index + 1, (v->size - index - 1) * sizeof(type)); \
+		v->size--; \
+	}
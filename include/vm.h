@@ -2,31 +2,163 @@
 
 typedef struct vm vm_t;
 
+#include <setjmp.h>
 #include <stddef.h>
 #include "buffer.h"
 #include "value.h"
 #include "objects.h"
+#include "vm/allocator.h"
 #include "vm/op_codes.h"
+#include "vm/reg_op_codes.h"
 
 typedef void (*error_handler_t)(const char* message);
+// Host code run by `vm_protect`
+typedef void (*vm_protected_t)(vm_t* vm, void* data);
 
+// Open addressing table of every string, removed entries are left as
+// tombstones so probing goes on past them. It is a weak set: collections do
+// not mark its strings, which leave it as they are swept.
 typedef struct {
 	string_t** buckets;
-	size_t capacity, count;
+	size_t capacity, count, tombstones;
 } string_pool_t;
 
+// A global variable resolved at compile time. The value is a copy of the
+// global table's entry, refreshed whenever the table's version changes.
+typedef struct global_slot {
+	value_t name;
+	value_t value;
+	uint32_t version;
+} global_slot_t;
+
+// Handle to a value pinned with `vm_pin`, valid until `vm_unpin`
+typedef size_t vm_root_t;
+
+// Slot of `vm->gc_pins`, unused ones are null and chained through `next_free`,
+// see src/gc.c
+typedef struct gc_pin {
+	value_t value;
+	size_t next_free;
+} gc_pin_t;
+
+DEFINE_VECTOR(pin_vector, gc_pin_t);
+
+typedef struct frame {
+	function_t* callee;
+	size_t stack_start;
+	union {
+		uint8_t* ip;
+		// Functions compiled by the register backend
+		reg_op_t* rip;
+	};
+} frame_t;
+
+typedef enum gc_phase {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP,
+} gc_phase_t;
+
+// Collector counters, see `vm_gc_stats`
+typedef struct gc_stats {
+	// Objects allocated and not freed yet, reachable or not
+	size_t objects[OBJECT_TYPE_COUNT];
+	size_t bytes[OBJECT_TYPE_COUNT];
+	size_t major_collections, minor_collections, compactions;
+	size_t freed_objects, freed_bytes;
+	// Nanoseconds the program was stopped by the collector
+	uint64_t total_pause, max_pause;
+	// Strings in the pool, its removed entries and its capacity
+	size_t strings, string_tombstones, string_buckets;
+} gc_stats_t;
+
+// Instruction format `vm_compile` generates code in. Functions are run by the
+// matching executor, so this must be set before compiling anything.
+typedef enum backend {
+	BACKEND_STACK,
+	BACKEND_REGISTER,
+} backend_t;
+
 struct vm {
 	char** arguments;
 	char** environment;
 	bool debug;
+	backend_t backend;
 	error_handler_t error_handler;
 
-	object_t* heap;
-	buffer_t gc_roots;
+	// Storage of every object
+	allocator_t allocator;
+	// Objects allocated since the last collection, the others are only known
+	// to the allocator
+	object_t* young;
+	// Values kept alive from C, pinned slots are reused through a free list
+	// starting at `gc_free_pin`, SIZE_MAX when it is empty
+	pin_vector_t gc_pins;
+	size_t gc_free_pin;
+	// Values kept alive until their handle scope closes, see `vm_open_handles`
+	value_vector_t gc_handles;
+	// Marked objects whose references are left to mark, kept between
+	// collections to reuse its storage
+	buffer_t gc_gray;
+	// Some marked object could not be pushed on a worklist, the heap is
+	// rescanned for it once they are empty
+	bool gc_gray_overflow;
+	// Bytes taken by the objects on the heap, a collection runs when an
+	// allocation brings them over `gc_next`
+	size_t gc_allocated, gc_next;
+	// Least value of `gc_next`
+	size_t gc_threshold;
+	// Bytes taken by the buffers of arrays and tables, and by the VM stack
+	size_t gc_buffer_bytes;
+	// Most bytes objects, their buffers and the stack may take, 0 for no
+	// limit. Going over it raises an out of memory error, see `vm_protect`.
+	size_t gc_limit;
+	// Bytes taken by young objects, a minor collection runs past `gc_nursery`
+	size_t gc_young_allocated, gc_nursery;
+	// Old objects that may refer to young ones, they are roots of minor
+	// collections
+	buffer_t gc_remembered;
+	// Some object could not be remembered, minor collections are major ones
+	// until the next major marking ends
+	bool gc_remembered_overflow;
+	bool gc_minor;
+	// Tables with weak keys or values, their pairs are cleared at the end of
+	// every major marking
+	buffer_t gc_weak_tables;
+	// Objects marked or swept by each allocation during a cycle, 0 runs
+	// whole cycles at once
+	size_t gc_step_work;
+	gc_phase_t gc_phase;
+	gc_stats_t gc_stats;
+	// Percentage of the heap's slabs compaction must release to run on its
+	// own, 0 only runs it through `vm_gc_compact`
+	unsigned gc_compact_ratio;
+	// Print a line on stderr after every collection
+	bool gc_trace;
+	// Nanoseconds spent in the current major cycle, for its trace
+	uint64_t gc_cycle_pause;
+	// Threads marking along with the collecting one when the world is
+	// stopped, 0 marks serially
+	size_t gc_mark_threads;
+	unsigned gc_freed;
 	table_t* global;
+	buffer_t global_slots;
+	table_t* global_slot_index;
 	string_pool_t string_pool;
 
-	buffer_t stack;
+	// Value stack, `sp` points right above the topmost value
+	value_t* stack;
+	value_t* sp;
+	size_t stack_capacity;
+
+	// Call stack, allocated once and shared by nested `vm_interpret` calls
+	frame_t* frames;
+	size_t frame_count, max_frames;
+	// Where out of memory errors unwind to, see `vm_protect`
+	jmp_buf* error_jump;
+
+	// Calls before a function is translated to machine code, 0 disables it
+	uint32_t jit_threshold;
 
 	// FIXME: make a class registrar
 	class_t* array_class;
@@ -37,27 +169,60 @@ struct vm {
 	class_t* table_class;
 };
 
-typedef struct frame {
-	function_t* callee;
-	size_t stack_start;
-	op_t* ip;
-} frame_t;
-
 vm_t* vm_open(char** environment, error_handler_t error);
 void vm_destroy(vm_t* vm);
+// Call depth limit, which must be positive
+bool vm_set_max_frames(vm_t* vm, size_t max_frames);
+
+size_t vm_global_slot(vm_t* vm, value_t name);
 
 value_t vm_compile(vm_t* vm, const char* source, const char* module);
 void vm_interpret(vm_t* vm, value_t callable, uint8_t argc);
+bool vm_protect(vm_t* vm, vm_protected_t fn, void* data);
+_Noreturn void vm_out_of_memory(vm_t* vm);
+void vm_buffer_push(vm_t* vm, buffer_t* buf, void* element);
 
+void vm_ensure_stack(vm_t* vm, size_t count);
 void vm_push(vm_t* vm, value_t value);
 value_t vm_pop(vm_t* vm);
 
+void vm_finalize(void* vm, void* obj);
 void vm_free(vm_t* vm, object_t* obj);
-void vm_gc_keep_alive(vm_t* vm, object_t* obj);
-void vm_gc_release(vm_t* vm, object_t* obj);
+vm_root_t vm_pin(vm_t* vm, value_t value);
+void vm_unpin(vm_t* vm, vm_root_t root);
+value_t vm_pinned(vm_t* vm, vm_root_t root);
+size_t vm_open_handles(vm_t* vm);
+void vm_handle(vm_t* vm, value_t value);
+void vm_close_handles(vm_t* vm, size_t scope);
 unsigned vm_gc_collect(vm_t* vm);
+unsigned vm_gc_collect_young(vm_t* vm);
+void vm_gc_step(vm_t* vm);
+void vm_gc_reserve(vm_t* vm, size_t size);
+void vm_gc_stats(vm_t* vm, gc_stats_t* stats);
+size_t vm_gc_compact(vm_t* vm);
+void vm_gc_safepoint(vm_t* vm);
+void vm_gc_shade(vm_t* vm, object_t* obj);
+void vm_gc_remember(vm_t* vm, object_t* obj);
+
+// Write barrier, called with any value stored into `obj`. While marking it
+// shades the value, as `obj` may already have been scanned. It remembers old
+// objects getting a young reference, marked ones about to be promoted count
+// as old.
+static inline void vm_gc_barrier(vm_t* vm, object_t* obj, value_t value)
+{
+	if (!IS_OBJECT(value))
+		return;
+	if (vm->gc_phase == GC_MARK)
+		vm_gc_shade(vm, AS_OBJECT(value));
+	bool old = allocator_is_old(obj) || (vm->gc_phase != GC_IDLE && allocator_is_marked(obj));
+	if (old && !obj->gc_remembered && !allocator_is_old(AS_OBJECT(value)))
+		vm_gc_remember(vm, obj);
+}
 
-void vm_init_string_pool(string_pool_t* sp, size_t capacity);
+bool vm_init_string_pool(string_pool_t* sp, size_t capacity);
 void vm_free_string_pool(string_pool_t* sp);
-string_t** vm_lookup_string_pool(string_pool_t* sp, const char* str, size_t length);
+string_t* vm_lookup_string_pool(string_pool_t* sp, const char* str, size_t length);
+bool vm_string_pool_reserve(string_pool_t* sp);
+void vm_string_pool_insert(string_pool_t* sp, string_t* string);
 void vm_string_pool_remove(string_pool_t* sp, string_t* string);
+void vm_string_pool_forward(string_pool_t* sp);
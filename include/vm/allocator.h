@@ -0,0 +1,155 @@
+#pragma once
+
+#include "config.h"
+
+// Segregated-fit allocator for objects. Each size class carves its blocks out
+// of slabs of its own: SLAB_SIZE bytes mapped from the OS at an aligned
+// address, so the slab of a block is found by masking its address. Freed
+// blocks go to the free list of their slab, which is unmapped once empty.
+// Blocks larger than every class get a slab to themselves.
+//
+// Collector state lives in bitmaps in the slabs' headers rather than in the
+// objects, so marking and sweeping do not write to the pages objects are on.
+// Sweeping is lazy: once started, a size class sweeps its slabs whenever it
+// runs out of blocks, and `allocator_sweep` sweeps the others bit by bit.
+//
+// Compaction moves the blocks of the emptiest slabs of each class into the
+// fullest ones. The first word of a moved block then holds its new address,
+// until its slab is released by `allocator_release_evacuated`.
+
+#define SLAB_SIZE (64 * 1024)
+
+// Blocks start on multiples of this, each of these spans has a bit in every
+// bitmap of its slab
+#define SLAB_GRANULE 16
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLAB_GRANULE / 64)
+
+// Sizes go up by 16 bytes to 128, then alternate between powers of two and
+// the halfway points between them
+#define SIZE_CLASS_COUNT 14
+#define LARGEST_SIZE_CLASS 1024
+
+typedef struct slab slab_t;
+
+// Called on every block swept while unmarked, before it is reused
+typedef void (*finalizer_t)(void* data, void* block);
+
+typedef struct size_class {
+	size_t size;
+	// Slabs with blocks left to allocate, the others, and the ones left to
+	// sweep
+	slab_t* partial;
+	slab_t* full;
+	slab_t* unswept;
+	size_t slabs;
+	size_t allocations, frees;
+} size_class_t;
+
+struct slab {
+	slab_t* prev;
+	slab_t* next;
+	// NULL for the slab of a large block
+	size_class_t* class;
+	// Freed blocks, linked through their first word
+	void* free;
+	// Blocks from here to `end` were never allocated
+	uint8_t* bump;
+	uint8_t* end;
+	uint32_t used;
+	// Emptied by compaction
+	bool evacuated;
+	// Bits of every granule, set for the blocks starting on it that are
+	// allocated, that are marked, and that survived a collection
+	uint64_t live[SLAB_BITMAP_WORDS];
+	uint64_t marks[SLAB_BITMAP_WORDS];
+	uint64_t old[SLAB_BITMAP_WORDS];
+};
+
+typedef struct allocator {
+	size_class_t classes[SIZE_CLASS_COUNT];
+	// Class of every size up to the largest one, in steps of 16
+	uint8_t class_of[LARGEST_SIZE_CLASS / 16 + 1];
+	// Slabs of blocks too large for any class
+	slab_t* large;
+	slab_t* large_unswept;
+	size_t large_allocations, large_frees;
+	// Slabs left to sweep, of every class
+	size_t unswept;
+	// Slabs emptied by compaction, waiting to be released
+	slab_t* evacuated;
+	finalizer_t finalize;
+	void* data;
+} allocator_t;
+
+void allocator_init(allocator_t* allocator, finalizer_t finalize, void* data);
+// Finalizes the blocks left
+void allocator_destroy(allocator_t* allocator);
+// Returns a zeroed block, or NULL
+void* allocator_alloc(allocator_t* allocator, size_t size);
+// `size` must be the one the block was allocated with
+void allocator_free(allocator_t* allocator, void* ptr, size_t size);
+
+// Unmarks every block
+void allocator_clear_marks(allocator_t* allocator);
+// Every slab is to be swept from now on. Unmarked blocks are finalized and
+// freed, the others are old.
+void allocator_start_sweep(allocator_t* allocator);
+// Sweeps slabs until `budget` blocks were looked at or none is left to sweep,
+// returns the blocks looked at
+size_t allocator_sweep(allocator_t* allocator, size_t budget);
+
+// Calls `fn` on every allocated block, but the evacuated ones
+void allocator_foreach(allocator_t* allocator, finalizer_t fn, void* data);
+
+// Percentage of the slabs compaction would release
+unsigned allocator_fragmentation(allocator_t* allocator);
+// Moves blocks out of the slabs compaction can release, returns how many
+size_t allocator_evacuate(allocator_t* allocator);
+// Once references to moved blocks are updated
+void allocator_release_evacuated(allocator_t* allocator);
+
+static inline slab_t* slab_of(void* ptr)
+{
+	return (slab_t*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static inline size_t granule_of(void* ptr)
+{
+	return ((uintptr_t)ptr & (SLAB_SIZE - 1)) / SLAB_GRANULE;
+}
+
+#define GRANULE_WORD(bitmap, ptr) (slab_of(ptr)->bitmap[granule_of(ptr) / 64])
+#define GRANULE_BIT(ptr) ((uint64_t)1 << (granule_of(ptr) % 64))
+
+static inline bool allocator_is_marked(void* ptr)
+{
+	return GRANULE_WORD(marks, ptr) & GRANULE_BIT(ptr);
+}
+
+static inline void allocator_mark(void* ptr)
+{
+	GRANULE_WORD(marks, ptr) |= GRANULE_BIT(ptr);
+}
+
+// Marks `ptr` even with other threads marking, returns false if it already was
+static inline bool allocator_mark_atomic(void* ptr)
+{
+	uint64_t bit = GRANULE_BIT(ptr);
+	return !(__atomic_fetch_or(&GRANULE_WORD(marks, ptr), bit, __ATOMIC_RELAXED) & bit);
+}
+
+static inline bool allocator_is_old(void* ptr)
+{
+	return GRANULE_WORD(old, ptr) & GRANULE_BIT(ptr);
+}
+
+static inline void allocator_set_old(void* ptr)
+{
+	GRANULE_WORD(old, ptr) |= GRANULE_BIT(ptr);
+}
+
+// Address the block at `ptr` was moved to, or `ptr`
+static inline void* allocator_forward(void* ptr)
+{
+	return slab_of(ptr)->evacuated ? *(void**)ptr : ptr;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "vm.h"
+
+// Interpreter internals shared with the JIT, see src/interpreter.c
+
+void runtime_error(vm_t* vm, const char* error, ...);
+frame_t* push_frame(vm_t* vm, value_t callable, uint8_t argc);
+frame_t* pop_frame(vm_t* vm, int8_t n_returned);
+frame_t* replace_frame(vm_t* vm, value_t callable, uint8_t argc);
+int8_t call_native(vm_t* vm, function_t* fn, uint8_t argc);
+class_t* get_class(vm_t* vm, value_t value);
+value_t get_property(vm_t* vm, function_t* fn, inline_cache_t* cache, class_t* class, value_t name);
+
+// Run the frame `vm->frames[base]`, which was just pushed, until it returns.
+// On error every frame from `base` is dropped and false is returned.
+bool interpret_frame(vm_t* vm, size_t base);
+
+static inline bool is_native(value_t value)
+{
+	return IS_FUNCTION(value) && AS_FUNCTION(value)->type == FUNCTION_NATIVE;
+}
@@ -3,58 +3,170 @@
 #include <stdint.h>
 
 #define __ENUMERATE_OP_CODES \
-	__ENUMERATE(NOP)         \
-	__ENUMERATE(PUSH)        \
-	__ENUMERATE(PUSH_FALSE)  \
-	__ENUMERATE(PUSH_TRUE)   \
-	__ENUMERATE(PUSH_CONST)  \
-	__ENUMERATE(LOAD)        \
-	__ENUMERATE(STORE)       \
-	__ENUMERATE(LOAD_UP)     \
-	__ENUMERATE(STORE_UP)    \
-	__ENUMERATE(ADD)         \
-	__ENUMERATE(SUB)         \
-	__ENUMERATE(MUL)         \
-	__ENUMERATE(DIV)         \
-	__ENUMERATE(MOD)         \
-	__ENUMERATE(POW)         \
-	__ENUMERATE(INC)         \
-	__ENUMERATE(DEC)         \
-	__ENUMERATE(NEG)         \
-	__ENUMERATE(EQ)          \
-	__ENUMERATE(NEQ)         \
-	__ENUMERATE(GT)          \
-	__ENUMERATE(GTE)         \
-	__ENUMERATE(LT)          \
-	__ENUMERATE(LTE)         \
-	__ENUMERATE(CMP)         \
-	__ENUMERATE(AND)         \
-	__ENUMERATE(OR)          \
-	__ENUMERATE(NOT)         \
-	__ENUMERATE(BAND)        \
-	__ENUMERATE(BOR)         \
-	__ENUMERATE(BNOT)        \
-	__ENUMERATE(XOR)         \
-	__ENUMERATE(LSH)         \
-	__ENUMERATE(RSH)         \
-	__ENUMERATE(GETG)        \
-	__ENUMERATE(GETP)        \
-	__ENUMERATE(CLOSE)       \
-	__ENUMERATE(CALL)        \
-	__ENUMERATE(RETURN)      \
-	__ENUMERATE(JUMP)        \
-	__ENUMERATE(JUMP_IF)     \
-	__ENUMERATE(MAKE_ARRAY)  \
-	__ENUMERATE(MAKE_TABLE)  \
+	__ENUMERATE(NOP, 0)          \
+	__ENUMERATE(PUSH, 1)         \
+	__ENUMERATE(PUSH_FALSE, 0)   \
+	__ENUMERATE(PUSH_TRUE, 0)    \
+	__ENUMERATE(PUSH_CONST, 1)   \
+	__ENUMERATE(LOAD, 1)         \
+	__ENUMERATE(STORE, 1)        \
+	__ENUMERATE(LOAD_UP, 1)      \
+	__ENUMERATE(STORE_UP, 1)     \
+	__ENUMERATE(ADD, 0)          \
+	__ENUMERATE(SUB, 0)          \
+	__ENUMERATE(MUL, 0)          \
+	__ENUMERATE(DIV, 0)          \
+	__ENUMERATE(MOD, 0)          \
+	__ENUMERATE(POW, 0)          \
+	__ENUMERATE(INC, 0)          \
+	__ENUMERATE(DEC, 0)          \
+	__ENUMERATE(NEG, 0)          \
+	__ENUMERATE(EQ, 0)           \
+	__ENUMERATE(NEQ, 0)          \
+	__ENUMERATE(GT, 0)           \
+	__ENUMERATE(GTE, 0)          \
+	__ENUMERATE(LT, 0)           \
+	__ENUMERATE(LTE, 0)          \
+	__ENUMERATE(CMP, 0)          \
+	__ENUMERATE(AND, 0)          \
+	__ENUMERATE(OR, 0)           \
+	__ENUMERATE(NOT, 0)          \
+	__ENUMERATE(BAND, 0)         \
+	__ENUMERATE(BOR, 0)          \
+	__ENUMERATE(BNOT, 0)         \
+	__ENUMERATE(XOR, 0)          \
+	__ENUMERATE(LSH, 0)          \
+	__ENUMERATE(RSH, 0)          \
+	__ENUMERATE(GETG, 0)         \
+	__ENUMERATE(GETG_SLOT, 1)    \
+	__ENUMERATE(SETG_SLOT, 1)    \
+	__ENUMERATE(GETP, 1)         \
+	__ENUMERATE(CLOSE, 1)        \
+	__ENUMERATE(CALL, 1)         \
+	__ENUMERATE(TAIL_CALL, 1)    \
+	__ENUMERATE(RETURN, 1)       \
+	__ENUMERATE(JUMP, 1)         \
+	__ENUMERATE(JUMP_IF, 1)      \
+	__ENUMERATE(MAKE_ARRAY, 1)   \
+	__ENUMERATE(MAKE_TABLE, 1)   \
+	__ENUMERATE(ADD_LL, 2)       \
+	__ENUMERATE(SUB_LL, 2)       \
+	__ENUMERATE(MUL_LL, 2)       \
+	__ENUMERATE(DIV_LL, 2)       \
+	__ENUMERATE(ADD_LK, 2)       \
+	__ENUMERATE(SUB_LK, 2)       \
+	__ENUMERATE(MUL_LK, 2)       \
+	__ENUMERATE(DIV_LK, 2)       \
+	__ENUMERATE(LT_LK, 2)        \
+	__ENUMERATE(LTE_LK, 2)       \
+	__ENUMERATE(GT_LK, 2)        \
+	__ENUMERATE(GTE_LK, 2)       \
+	__ENUMERATE(EQ_JUMP_IF, 1)   \
+	__ENUMERATE(NEQ_JUMP_IF, 1)  \
+	__ENUMERATE(LT_JUMP_IF, 1)   \
+	__ENUMERATE(LTE_JUMP_IF, 1)  \
+	__ENUMERATE(GT_JUMP_IF, 1)   \
+	__ENUMERATE(GTE_JUMP_IF, 1)  \
+	__ENUMERATE(LT_LL_JUMP_IF, 3) \
+	__ENUMERATE(LTE_LL_JUMP_IF, 3) \
+	__ENUMERATE(GT_LL_JUMP_IF, 3) \
+	__ENUMERATE(GTE_LL_JUMP_IF, 3) \
+	__ENUMERATE(LT_LK_JUMP_IF, 3) \
+	__ENUMERATE(LTE_LK_JUMP_IF, 3) \
+	__ENUMERATE(GT_LK_JUMP_IF, 3) \
+	__ENUMERATE(GTE_LK_JUMP_IF, 3) \
+	__ENUMERATE(INVOKE, 2)       \
+	__ENUMERATE(ADD_NUM, 0)      \
+	__ENUMERATE(SUB_NUM, 0)      \
+	__ENUMERATE(MUL_NUM, 0)      \
+	__ENUMERATE(DIV_NUM, 0)      \
+	__ENUMERATE(GT_NUM, 0)       \
+	__ENUMERATE(GTE_NUM, 0)      \
+	__ENUMERATE(LT_NUM, 0)       \
+	__ENUMERATE(LTE_NUM, 0)      \
+	__ENUMERATE(ADD_DEOPT, 0)    \
+	__ENUMERATE(SUB_DEOPT, 0)    \
+	__ENUMERATE(MUL_DEOPT, 0)    \
+	__ENUMERATE(DIV_DEOPT, 0)    \
+	__ENUMERATE(GT_DEOPT, 0)     \
+	__ENUMERATE(GTE_DEOPT, 0)    \
+	__ENUMERATE(LT_DEOPT, 0)     \
+	__ENUMERATE(LTE_DEOPT, 0)    \
+	__ENUMERATE(WIDE, 1)         \
 
 
 typedef enum op_code {
-#define __ENUMERATE(o) OP_ ## o,
+#define __ENUMERATE(o, operands) OP_ ## o,
 	__ENUMERATE_OP_CODES
 #undef __ENUMERATE
 } op_code_t;
 
+// Instructions are encoded as their op code byte followed by their operands,
+// one byte each. A larger operand is split in bytes, all but the least
+// significant one are held by WIDE prefixes in front of the instruction:
+//
+//   WIDE 0x01  WIDE 0x02  PUSH_CONST 0x03    pushes constant 0x010203
+//
+// Jump offsets are counted from the op code of the jump, and only go forward.
+// Instructions with two operands never have prefixes. Instructions with three
+// operands are jumps followed by two byte-sized operands, their prefixes only
+// widen the jump offset:
+//
+//   WIDE 0x01  LT_LK_JUMP_IF 0x02 0x03 0x04    jumps 0x0102 forward unless
+//                                              local 0x04 < constant 0x03
+
+// The compiler works on decoded instructions, which are only encoded once the
+// code of a function is complete, see src/compiler/encoding.c
 typedef struct op {
 	op_code_t op;
-	int16_t arg;
+	int32_t arg;
+	// Byte-sized operands following the jump offset of three operand
+	// instructions, packed with OP_ARGS
+	uint16_t bytes;
 } op_t;
+
+// Superinstructions pack two byte-sized operands in their argument, `a` being
+// the operand of the first instruction of the fused sequence.
+#define OP_ARGS(a, b) ((int32_t)((a) | ((b) << 8)))
+#define OP_ARG_A(arg) ((uint32_t)(arg) & 0xFF)
+#define OP_ARG_B(arg) (((uint32_t)(arg) >> 8) & 0xFF)
+
+static inline uint8_t op_operands(uint8_t op)
+{
+	static const uint8_t operands[] = {
+#define __ENUMERATE(o, operands) operands,
+		__ENUMERATE_OP_CODES
+#undef __ENUMERATE
+	};
+	return operands[op];
+}
+
+// Byte-sized operands of a superinstruction, packed with OP_ARGS
+static inline uint32_t op_byte_args(const op_t* op)
+{
+	return op_operands(op->op) == 3 ? op->bytes : (uint32_t)op->arg;
+}
+
+// Size of an instruction, prefixes excluded
+static inline uint8_t op_length(uint8_t op)
+{
+	return 1 + op_operands(op);
+}
+
+// Decode the instruction starting at `code` and return the address of its op
+// code, past its prefixes.
+static inline const uint8_t* op_decode(const uint8_t* code, op_t* op)
+{
+	uint32_t arg = 0;
+	for (; *code == OP_WIDE; code += 2)
+		arg = arg << 8 | code[1];
+	op->op = *code;
+	op->bytes = 0;
+	switch (op_operands(*code)) {
+	case 1: arg = arg << 8 | code[1]; break;
+	case 2: arg = OP_ARGS(code[1], code[2]); break;
+	case 3: arg = arg << 8 | code[1]; op->bytes = OP_ARGS(code[2], code[3]); break;
+	}
+	op->arg = arg;
+	return code;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+
+// Instructions of the register backend, see `BACKEND_REGISTER`. Registers are
+// the slots of the function's frame, locals first then temporaries.
+#define __ENUMERATE_REG_OP_CODES \
+	__ENUMERATE(NOP)         \
+	__ENUMERATE(MOVE)        \
+	__ENUMERATE(LOADK)       \
+	__ENUMERATE(LOADNULL)    \
+	__ENUMERATE(LOADBOOL)    \
+	__ENUMERATE(GETUP)       \
+	__ENUMERATE(GETG)        \
+	__ENUMERATE(GETP)        \
+	__ENUMERATE(EXTRA)       \
+	__ENUMERATE(ADD)         \
+	__ENUMERATE(SUB)         \
+	__ENUMERATE(MUL)         \
+	__ENUMERATE(DIV)         \
+	__ENUMERATE(MOD)         \
+	__ENUMERATE(POW)         \
+	__ENUMERATE(EQ)          \
+	__ENUMERATE(NEQ)         \
+	__ENUMERATE(GT)          \
+	__ENUMERATE(GTE)         \
+	__ENUMERATE(LT)          \
+	__ENUMERATE(LTE)         \
+	__ENUMERATE(CMP)         \
+	__ENUMERATE(AND)         \
+	__ENUMERATE(OR)          \
+	__ENUMERATE(BAND)        \
+	__ENUMERATE(BOR)         \
+	__ENUMERATE(XOR)         \
+	__ENUMERATE(LSH)         \
+	__ENUMERATE(RSH)         \
+	__ENUMERATE(CLOSE)       \
+	__ENUMERATE(CALL)        \
+	__ENUMERATE(RETURN)      \
+	__ENUMERATE(JUMP)        \
+	__ENUMERATE(JUMP_IF)     \
+
+
+typedef enum reg_op_code {
+#define __ENUMERATE(o) ROP_ ## o,
+	__ENUMERATE_REG_OP_CODES
+#undef __ENUMERATE
+} reg_op_code_t;
+
+// MOVE      a b    R[a] = R[b]
+// LOADK     a bx   R[a] = K[bx]
+// LOADNULL  a      R[a] = null
+// LOADBOOL  a b    R[a] = b != 0
+// GETUP     a b    R[a] = captures[b]
+// GETG      a bx   R[a] = global slot bx
+// GETP      a b c  R[a] = R[b].K[bx] with inline cache c, bx being in the next
+//                  EXTRA instruction
+// <binary>  a b c  R[a] = R[b] <op> R[c]
+// CLOSE     a b c  Append R[b] to R[b + c - 1] to R[a]'s captures
+// CALL      a b c  R[a] = R[a](b arguments), the arguments are in R[a + 1]
+//                  onward in reverse order followed by `this` if c != 0
+// RETURN    a b    Return R[a] if b != 0
+// JUMP        bx   Jump bx instructions
+// JUMP_IF   a bx   Jump bx instructions if R[a] is false
+typedef struct reg_op {
+	uint8_t op, a;
+	union {
+		struct {
+			uint8_t b, c;
+		};
+		int16_t bx;
+	};
+} reg_op_t;
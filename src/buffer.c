@@ -1,4 +1,3 @@
-#include <assert.h>
 #include <string.h>
 #include "buffer.h"
 
@@ -23,23 +22,18 @@ void buffer_free(buffer_t* buf)
 
 bool buffer_push(buffer_t* buf, void* element)
 {
-	bool has_allocated = false;
-
 	if (buf->size + 1 > buf->capacity) {
-		void* new_buffer = ALLOC(buf->element_size * (buf->capacity + 16));
-		assert(new_buffer);
-		has_allocated = true;
-		if (buf->data != NULL) {
-			memmove(new_buffer, buf->data, buf->element_size * buf->capacity);
-			FREE(buf->data);
-		}
+		size_t capacity = buf->capacity > 0 ? buf->capacity * 2 : BUFFER_MIN_CAPACITY;
+		void* new_buffer = REALLOC(buf->data, buf->element_size * capacity);
+		if (!new_buffer)
+			return false;
 		buf->data = new_buffer;
-		buf->capacity += 16;
+		buf->capacity = capacity;
 	}
 
 	memcpy((uint8_t*)buf->data + buf->element_size * buf->size, element, buf->element_size);
 	buf->size++;
-	return has_allocated;
+	return true;
 }
 
 void* buffer_at(buffer_t* buf, size_t index)
@@ -58,11 +52,10 @@ void buffer_splice(buffer_t* buf, size_t start, size_t length)
 {
 	if (start >= buf->size || length == 0)
 		return;
-	memmove(
-		buffer_at(buf, start),
-		buffer_at(buf, start + length),
-		(buf->size - (start + length)) * buf->element_size
-	);
+	if (length > buf->size - start)
+		length = buf->size - start;
+	uint8_t* at = (uint8_t*)buf->data + start * buf->element_size;
+	memmove(at, at + length * buf->element_size, (buf->size - (start + length)) * buf->element_size);
 	buf->size -= length;
 }
 
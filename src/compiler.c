@@ -30,19 +30,19 @@ static op_code_t binary_op(token_type_t token)
 	return OP_NOP;
 }
 
-static inline op_t* emit_arg(function_t* fn, op_code_t op, uint8_t arg) {
-	op_t o = { op, arg };
-	buffer_push(&fn->compiled.code, &o);
+static inline op_t* emit_arg(vm_t* vm, function_t* fn, op_code_t op, int32_t arg) {
+	op_t o = { op, arg, 0 };
+	vm_buffer_push(vm, &fn->compiled.code, &o);
 	return buffer_last(&fn->compiled.code);
 }
 
-static inline op_t* emit(function_t* fn, op_code_t op) {
-	return emit_arg(fn, op, 0);
+static inline op_t* emit(vm_t* vm, function_t* fn, op_code_t op) {
+	return emit_arg(vm, fn, op, 0);
 }
 
-static inline size_t emit_jump(function_t* fn, op_code_t op) {
+static inline size_t emit_jump(vm_t* vm, function_t* fn, op_code_t op) {
 	size_t start = fn->compiled.code.size;
-	emit_arg(fn, op, 0);
+	emit_arg(vm, fn, op, 0);
 	return start;
 }
 
@@ -51,15 +51,79 @@ static inline void patch_jump(function_t* fn, size_t jump_start) {
 	op->arg = fn->compiled.code.size - jump_start;
 }
 
-static size_t add_constant(function_t* fn, value_t constant)
+static size_t add_constant(vm_t* vm, function_t* fn, value_t constant)
 {
 	for (size_t i = 0; i < fn->compiled.constants.size; ++i)
-		if (*(value_t*)buffer_at(&fn->compiled.constants, i) == constant)
+		if (fn->compiled.constants.data[i] == constant)
 			return i;
-	buffer_push(&fn->compiled.constants, &constant);
+	// The function may have been promoted while being compiled
+	vm_gc_barrier(vm, &fn->header, constant);
+	value_vector_push(&fn->compiled.constants, constant);
 	return fn->compiled.constants.size - 1;
 }
 
+// How much an instruction grows the stack, every instruction pops its operands
+// before pushing its results.
+static int stack_effect(op_t* op)
+{
+	switch (op->op) {
+	case OP_PUSH: return op->arg;
+	case OP_PUSH_FALSE:
+	case OP_PUSH_TRUE:
+	case OP_PUSH_CONST:
+	case OP_LOAD:
+	case OP_LOAD_UP:
+	case OP_GETG_SLOT: return 1;
+	case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL:
+	case OP_ADD_LK: case OP_SUB_LK: case OP_MUL_LK: case OP_DIV_LK:
+	case OP_LT_LK: case OP_LTE_LK: case OP_GT_LK: case OP_GTE_LK: return 1;
+	case OP_STORE_UP:
+	case OP_JUMP_IF: return -1;
+	case OP_EQ_JUMP_IF: case OP_NEQ_JUMP_IF:
+	case OP_LT_JUMP_IF: case OP_LTE_JUMP_IF: case OP_GT_JUMP_IF: case OP_GTE_JUMP_IF: return -2;
+	case OP_LT_LL_JUMP_IF: case OP_LTE_LL_JUMP_IF: case OP_GT_LL_JUMP_IF: case OP_GTE_LL_JUMP_IF:
+	case OP_LT_LK_JUMP_IF: case OP_LTE_LK_JUMP_IF: case OP_GT_LK_JUMP_IF: case OP_GTE_LK_JUMP_IF: return 0;
+	case OP_CLOSE: return -op->arg;
+	// The callee is replaced by its return value
+	case OP_CALL:
+	case OP_TAIL_CALL: return -op->arg;
+	case OP_INVOKE: return -OP_ARG_B(op->arg);
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_MOD: case OP_POW:
+	case OP_EQ: case OP_NEQ: case OP_GT: case OP_GTE: case OP_LT: case OP_LTE: case OP_CMP:
+	case OP_AND: case OP_OR: case OP_BAND: case OP_BOR: case OP_XOR: case OP_LSH: case OP_RSH:
+	case OP_ADD_NUM: case OP_SUB_NUM: case OP_MUL_NUM: case OP_DIV_NUM:
+	case OP_GT_NUM: case OP_GTE_NUM: case OP_LT_NUM: case OP_LTE_NUM:
+	case OP_ADD_DEOPT: case OP_SUB_DEOPT: case OP_MUL_DEOPT: case OP_DIV_DEOPT:
+	case OP_GT_DEOPT: case OP_GTE_DEOPT: case OP_LT_DEOPT: case OP_LTE_DEOPT:
+		return -1;
+	default: return 0;
+	}
+}
+
+// Walk the code linearly, both sides of a branch are accounted for so this
+// over-estimates a bit, which is fine for sizing the stack.
+static void compute_max_stack(function_t* fn)
+{
+	int depth = 0;
+	size_t max = 0;
+	buffer_foreach(fn->compiled.code, op_t, op) {
+		depth += stack_effect(op);
+		if (depth > 0 && (size_t)depth > max)
+			max = depth;
+	}
+	fn->compiled.max_stack = max;
+}
+
+#include "compiler/superinstructions.c"
+#include "compiler/encoding.c"
+
+static size_t add_inline_cache(vm_t* vm, function_t* fn)
+{
+	inline_cache_t cache = { 0 };
+	vm_buffer_push(vm, &fn->compiled.caches, &cache);
+	return fn->compiled.caches.size - 1;
+}
+
 static inline bool token_equals(token_t* a, token_t* b) {
 	return a->type == b->type && a->type == TOKEN_IDENTIFIER && a->index == b->index;
 }
@@ -79,89 +143,122 @@ static size_t scope_find_local(scope_t* scope, token_t* t)
 	return NOT_FOUND;
 }
 
+static void compile(vm_t* vm, function_t* fn, ast_node_t* node, scope_t* scope);
+
+static void compile_call(vm_t* vm, function_t* fn, ast_node_t* node, scope_t* scope, op_code_t op)
+{
+	for (size_t i = 0; i < node->call.arguments.size; ++i)
+		compile(vm, fn, *(ast_node_t**)buffer_at(&node->call.arguments, node->call.arguments.size - i - 1), scope);
+	compile(vm, fn, node->call.callee, scope);
+	emit_arg(vm, fn, op, node->call.arguments.size);
+}
+
+// Return the value of `node`. Calls in tail position, including those in both
+// branches of a ternary, reuse the frame of the function.
+static void compile_return(vm_t* vm, function_t* fn, ast_node_t* node, scope_t* scope)
+{
+	if (node->type == AST_CALL) {
+		compile_call(vm, fn, node, scope, OP_TAIL_CALL);
+	} else if (node->type == AST_BRANCH && node->branch.alternate && node->branch.consequent->type != AST_BLOCK) {
+		compile(vm, fn, node->branch.condition, scope);
+		size_t if_jump = emit_jump(vm, fn, OP_JUMP_IF);
+		compile_return(vm, fn, node->branch.consequent, scope);
+		patch_jump(fn, if_jump);
+		compile_return(vm, fn, node->branch.alternate, scope);
+	} else {
+		compile(vm, fn, node, scope);
+		emit_arg(vm, fn, OP_RETURN, 1);
+	}
+}
+
 static void compile(vm_t* vm, function_t* fn, ast_node_t* node, scope_t* scope)
 {
 	switch (node->type) {
 	case AST_BINARY:
 		compile(vm, fn, node->binary.rhs, scope);
 		compile(vm, fn, node->binary.lhs, scope);
-		emit(fn, binary_op(node->binary.operator));
+		emit(vm, fn, binary_op(node->binary.operator));
 		break;
 	case AST_BLOCK:
 		buffer_foreach(node->block.body, ast_node_t*, child) {
 			compile(vm, fn, *child, node->block.scope);
 		}
-		if (fn->compiled.code.size == 0 || ((op_t*)buffer_at(&fn->compiled.code, fn->compiled.code.size - 1))->op != OP_RETURN)
-			emit(fn, OP_RETURN);
+		if (fn->compiled.code.size == 0) {
+			emit(vm, fn, OP_RETURN);
+		} else {
+			op_code_t last = ((op_t*)buffer_last(&fn->compiled.code))->op;
+			if (last != OP_RETURN && last != OP_TAIL_CALL)
+				emit(vm, fn, OP_RETURN);
+		}
 		break;
 	case AST_BRANCH: {
 		compile(vm, fn, node->branch.condition, scope);
-		size_t if_jump = emit_jump(fn, OP_JUMP_IF);
+		size_t if_jump = emit_jump(vm, fn, OP_JUMP_IF);
 		compile(vm, fn, node->branch.consequent, scope);
-		size_t else_jump = emit_jump(fn, OP_JUMP);
+		size_t else_jump = emit_jump(vm, fn, OP_JUMP);
 		patch_jump(fn, if_jump);
 		compile(vm, fn, node->branch.alternate, scope);
 		patch_jump(fn, else_jump);
 	}	break;
 	case AST_CALL:
-		for (size_t i = 0; i < node->call.arguments.size; ++i)
-			compile(vm, fn, *(ast_node_t**)buffer_at(&node->call.arguments, node->call.arguments.size - i - 1), scope);
-		compile(vm, fn, node->call.callee, scope);
-		emit_arg(fn, OP_CALL, node->call.arguments.size);
+		compile_call(vm, fn, node, scope, OP_CALL);
 		break;
 	case AST_FUNCTION: {
 		function_t* inner_fn = new_function(vm, node->function.parameters.size);
-		size_t index = add_constant(fn, VALUE_OBJECT(inner_fn));
+		size_t index = add_constant(vm, fn, VALUE_OBJECT(inner_fn));
 		compile(vm, inner_fn, node->function.body, scope);
-		emit_arg(fn, OP_PUSH_CONST, index);
+		fuse_superinstructions(inner_fn);
+		compute_max_stack(inner_fn);
+		encode_function(vm, inner_fn);
+		emit_arg(vm, fn, OP_PUSH_CONST, index);
 		scope_t* fn_scope = node->function.body->block.scope;
 		if (fn_scope->upvalues.size > 0) {
 			for (size_t i = 0; i < fn_scope->upvalues.size; ++i) {
 				size_t index = scope_find_local(scope, buffer_at(&fn_scope->upvalues, fn_scope->upvalues.size - i - 1));
-				emit_arg(fn,
+				emit_arg(vm, fn,
 					(index & UPVALUE_MASK) == UPVALUE_MASK ? OP_LOAD_UP : OP_LOAD,
 					(index & UPVALUE_MASK) == UPVALUE_MASK ? index & ~UPVALUE_MASK : index
 				);
 			}
-			emit_arg(fn, OP_PUSH_CONST, index);
-			emit_arg(fn, OP_CLOSE, fn_scope->upvalues.size);
+			emit_arg(vm, fn, OP_PUSH_CONST, index);
+			emit_arg(vm, fn, OP_CLOSE, fn_scope->upvalues.size);
 		}
 	}	break;
 	case AST_IDENTIFIER: {
 		size_t index = scope_find_local(scope, &node->identifier.token);
 		if (index == NOT_FOUND) {
-			emit_arg(fn, OP_PUSH_CONST, add_constant(fn, VALUE_OBJECT(new_string(vm, node->identifier.id->name))));
-			emit(fn, OP_GETG);
+			emit_arg(vm, fn, OP_GETG_SLOT, vm_global_slot(vm, VALUE_OBJECT(new_string(vm, node->identifier.name))));
 		} else if ((index & UPVALUE_MASK) == UPVALUE_MASK) {
-			emit_arg(fn, OP_LOAD_UP, index & ~UPVALUE_MASK);
+			emit_arg(vm, fn, OP_LOAD_UP, index & ~UPVALUE_MASK);
 		} else {
-			emit_arg(fn, OP_LOAD, index);
+			emit_arg(vm, fn, OP_LOAD, index);
 		}
 	}	break;
 	case AST_LITERAL: {
 		switch (node->literal.type) {
-		case TOKEN_NULL: emit_arg(fn, OP_PUSH, 1); break;
-		case TOKEN_FALSE: emit(fn, OP_PUSH_FALSE); break;
-		case TOKEN_TRUE: emit(fn, OP_PUSH_TRUE); break;
+		case TOKEN_NULL: emit_arg(vm, fn, OP_PUSH, 1); break;
+		case TOKEN_FALSE: emit(vm, fn, OP_PUSH_FALSE); break;
+		case TOKEN_TRUE: emit(vm, fn, OP_PUSH_TRUE); break;
 		case TOKEN_NUMBER:
-			emit_arg(fn, OP_PUSH_CONST, add_constant(fn, VALUE_NUMBER(node->literal.lit->number)));
+			emit_arg(vm, fn, OP_PUSH_CONST, add_constant(vm, fn, VALUE_NUMBER(node->literal.lit.number)));
 			break;
 		case TOKEN_STRING:
-			emit_arg(fn, OP_PUSH_CONST, add_constant(fn, VALUE_OBJECT(new_string_length(vm, node->literal.lit->string.start, node->literal.lit->string.length))));
+			emit_arg(vm, fn, OP_PUSH_CONST, add_constant(vm, fn, VALUE_OBJECT(new_string_length(vm, node->literal.lit.string.start, node->literal.lit.string.length))));
 			break;
 		default: break;
 		}
 	}	break;
 	case AST_PROPERTY:
 		// TODO: implement ?.
-		emit_arg(fn, OP_PUSH_CONST, add_constant(fn, VALUE_OBJECT(new_string(vm, node->property.name->name))));
+		emit_arg(vm, fn, OP_PUSH_CONST, add_constant(vm, fn, VALUE_OBJECT(new_string(vm, node->property.name))));
 		compile(vm, fn, node->property.lhs, scope);
-		emit(fn, OP_GETP);
+		emit_arg(vm, fn, OP_GETP, add_inline_cache(vm, fn));
 		break;
 	case AST_RETURN:
 		if (node->ret.expression)
-			compile(vm, fn, node->ret.expression, scope);
-		emit_arg(fn, OP_RETURN, node->ret.expression ? 1 : 0);
+			compile_return(vm, fn, node->ret.expression, scope);
+		else
+			emit_arg(vm, fn, OP_RETURN, 0);
 		break;
 	case AST_UNARY: printf("AST_UNARY\n");
 		break;
@@ -169,25 +266,60 @@ static void compile(vm_t* vm, function_t* fn, ast_node_t* node, scope_t* scope)
 		size_t index = scope_find_local(scope, &node->var.identifier);
 		assert(index != UPVALUE_MASK);
 		compile(vm, fn, node->var.initializer, scope);
-		emit_arg(fn, OP_STORE, index);
+		emit_arg(vm, fn, OP_STORE, index);
 	}	break;
 	}
 }
 
-value_t vm_compile(vm_t* vm, const char* source, const char* module)
+#include "compiler/registers.c"
+
+typedef struct compilation {
+	const char* source;
+	const char* module;
+	parser_t parser;
+	bool parsed;
+	value_t fn;
+} compilation_t;
+
+static void compile_source(vm_t* vm, void* data)
 {
-	parser_t parser = parse(vm, source, module);
-	if (!parser.root) {
-		return VALUE_NULL;
-	}
+	compilation_t* c = data;
+	c->parser = parse(vm, c->source, c->module);
+	c->parsed = true;
+	if (!c->parser.root)
+		return;
 
-	if (vm->debug) parser_dump_node(&parser, parser.root, 0);
+	if (vm->debug) parser_dump_node(&c->parser, c->parser.root, 0);
 
 	function_t* fn = new_function(vm, 0);
-	vm_gc_keep_alive(vm, (object_t*) fn);
+	size_t scope = vm_open_handles(vm);
+	vm_handle(vm, VALUE_OBJECT(fn));
+
+	if (vm->backend == BACKEND_REGISTER) {
+		if (!compile_registers(vm, fn, c->parser.root, c->parser.scope)) {
+			vm_close_handles(vm, scope);
+			return;
+		}
+	} else {
+		compile(vm, fn, c->parser.root, c->parser.scope);
+		fuse_superinstructions(fn);
+		compute_max_stack(fn);
+		encode_function(vm, fn);
+	}
 
-	compile(vm, fn, parser.root, parser.scope);
+	// The caller runs it right away, which keeps it alive from then on
+	vm_close_handles(vm, scope);
+	c->fn = VALUE_OBJECT(fn);
+}
 
-	parser_free(&parser);
-	return VALUE_OBJECT(fn);
+// Returns null if the source does not compile or memory runs out, the error is
+// reported to the error handler. Running out while parsing leaks the syntax
+// tree built so far.
+value_t vm_compile(vm_t* vm, const char* source, const char* module)
+{
+	compilation_t c = { .source = source, .module = module, .fn = VALUE_NULL };
+	vm_protect(vm, compile_source, &c);
+	if (c.parsed)
+		parser_free(&c.parser);
+	return c.fn;
 }
@@ -0,0 +1,81 @@
+// Encodes the instructions of a function into the byte code the interpreter
+// runs, see include/vm/op_codes.h. Widening a jump moves everything after it
+// further away, so the prefixes of jumps are grown until every offset fits.
+
+// WIDE prefixes needed in front of an operand
+static inline uint8_t wide_prefixes(uint32_t arg)
+{
+	uint8_t n = 0;
+	for (; arg > 0xFF; arg >>= 8)
+		n++;
+	return n;
+}
+
+static void encode_function(vm_t* vm, function_t* fn)
+{
+	op_t* code = fn->compiled.code.data;
+	size_t size = fn->compiled.code.size;
+
+	// Encoded offset of every instruction, prefixes included, and of the end
+	size_t* offsets = ALLOC((size + 1) * sizeof(size_t));
+	uint8_t* prefixes = ALLOC(size + 1);
+	buffer_t bytes = buffer_new(sizeof(uint8_t));
+	if (!offsets || !prefixes)
+		goto out_of_memory;
+
+	for (size_t i = 0; i < size; ++i)
+		prefixes[i] = is_jump(code[i].op) || op_operands(code[i].op) != 1 ? 0 : wide_prefixes(code[i].arg);
+
+#define JUMP_OFFSET(i) (offsets[(i) + code[i].arg] - offsets[i] - 2 * prefixes[i])
+	bool relaxed;
+	do {
+		size_t offset = 0;
+		for (size_t i = 0; i < size; ++i) {
+			offsets[i] = offset;
+			offset += 2 * prefixes[i] + op_length(code[i].op);
+		}
+		offsets[size] = offset;
+
+		relaxed = true;
+		for (size_t i = 0; i < size; ++i) {
+			if (!is_jump(code[i].op))
+				continue;
+			uint8_t needed = wide_prefixes(JUMP_OFFSET(i));
+			if (needed > prefixes[i]) {
+				prefixes[i] = needed;
+				relaxed = false;
+			}
+		}
+	} while (!relaxed);
+
+	for (size_t i = 0; i < size; ++i) {
+		uint32_t arg = is_jump(code[i].op) ? JUMP_OFFSET(i) : (uint32_t)code[i].arg;
+		for (uint8_t p = prefixes[i]; p > 0; --p) {
+			uint8_t prefix[] = { OP_WIDE, arg >> (8 * p) };
+			if (!buffer_push(&bytes, &prefix[0]) || !buffer_push(&bytes, &prefix[1]))
+				goto out_of_memory;
+		}
+		uint8_t encoded[] = { code[i].op, OP_ARG_A(arg), OP_ARG_B(arg), 0 };
+		if (op_operands(code[i].op) == 3) {
+			encoded[2] = OP_ARG_A(code[i].bytes);
+			encoded[3] = OP_ARG_B(code[i].bytes);
+		}
+		for (uint8_t j = 0; j < op_length(code[i].op); ++j) {
+			if (!buffer_push(&bytes, &encoded[j]))
+				goto out_of_memory;
+		}
+	}
+#undef JUMP_OFFSET
+
+	buffer_free(&fn->compiled.code);
+	fn->compiled.code = bytes;
+	FREE(offsets);
+	FREE(prefixes);
+	return;
+
+out_of_memory:
+	buffer_free(&bytes);
+	FREE(offsets);
+	FREE(prefixes);
+	vm_out_of_memory(vm);
+}
@@ -0,0 +1,263 @@
+// Register backend, generates `reg_op_t` code. Locals live in the registers
+// numbered after their index in the scope, temporaries are allocated above
+// them in a stack-like fashion so that the callee of a call and its arguments
+// are always the topmost registers.
+
+typedef struct reg_compiler {
+	vm_t* vm;
+	function_t* fn;
+	// First free register, kept wider than a register index to catch overflows
+	size_t top;
+	bool failed;
+} reg_compiler_t;
+
+static void reg_error(reg_compiler_t* rc, const char* error)
+{
+	if (!rc->failed)
+		rc->vm->error_handler(error);
+	rc->failed = true;
+}
+
+static inline uint8_t reg_operand_fits(reg_compiler_t* rc, size_t operand)
+{
+	if (operand > UINT8_MAX)
+		reg_error(rc, "compile error: function is too large for the register backend");
+	return operand;
+}
+
+static inline reg_op_t* reg_emit(reg_compiler_t* rc, reg_op_code_t op, uint8_t a, uint8_t b, uint8_t c)
+{
+	reg_op_t o = { .op = op, .a = a, .b = b, .c = c };
+	vm_buffer_push(rc->vm, &rc->fn->compiled.code, &o);
+	return buffer_last(&rc->fn->compiled.code);
+}
+
+static inline reg_op_t* reg_emit_bx(reg_compiler_t* rc, reg_op_code_t op, uint8_t a, size_t bx)
+{
+	if (bx > INT16_MAX)
+		reg_error(rc, "compile error: function is too large for the register backend");
+	reg_op_t o = { .op = op, .a = a, .bx = bx };
+	vm_buffer_push(rc->vm, &rc->fn->compiled.code, &o);
+	return buffer_last(&rc->fn->compiled.code);
+}
+
+static inline void reg_patch_jump(reg_compiler_t* rc, size_t jump_start)
+{
+	reg_op_t* op = buffer_at(&rc->fn->compiled.code, jump_start);
+	op->bx = rc->fn->compiled.code.size - jump_start;
+}
+
+static uint8_t reg_alloc(reg_compiler_t* rc)
+{
+	uint8_t reg = reg_operand_fits(rc, rc->top++);
+	if (rc->top > rc->fn->compiled.max_stack)
+		rc->fn->compiled.max_stack = rc->top;
+	return reg;
+}
+
+static reg_op_code_t reg_binary_op(token_type_t token)
+{
+	switch (binary_op(token)) {
+	case OP_ADD: return ROP_ADD;
+	case OP_SUB: return ROP_SUB;
+	case OP_MUL: return ROP_MUL;
+	case OP_DIV: return ROP_DIV;
+	case OP_MOD: return ROP_MOD;
+	case OP_POW: return ROP_POW;
+	case OP_EQ: return ROP_EQ;
+	case OP_NEQ: return ROP_NEQ;
+	case OP_GT: return ROP_GT;
+	case OP_GTE: return ROP_GTE;
+	case OP_LT: return ROP_LT;
+	case OP_LTE: return ROP_LTE;
+	case OP_CMP: return ROP_CMP;
+	case OP_AND: return ROP_AND;
+	case OP_OR: return ROP_OR;
+	case OP_BAND: return ROP_BAND;
+	case OP_BOR: return ROP_BOR;
+	case OP_XOR: return ROP_XOR;
+	case OP_LSH: return ROP_LSH;
+	case OP_RSH: return ROP_RSH;
+	default: assert(false); return ROP_NOP;
+	}
+}
+
+static void reg_expression(reg_compiler_t* rc, ast_node_t* node, scope_t* scope, uint8_t dest);
+
+// Register holding the value of `node`, locals are used in place
+static uint8_t reg_operand(reg_compiler_t* rc, ast_node_t* node, scope_t* scope)
+{
+	if (node->type == AST_IDENTIFIER) {
+		size_t index = scope_find_local(scope, &node->identifier.token);
+		if (index != NOT_FOUND && (index & UPVALUE_MASK) != UPVALUE_MASK)
+			return index;
+	}
+
+	uint8_t reg = reg_alloc(rc);
+	reg_expression(rc, node, scope, reg);
+	return reg;
+}
+
+static void reg_call(reg_compiler_t* rc, ast_node_t* node, scope_t* scope, uint8_t dest)
+{
+	size_t top = rc->top;
+	size_t argc = node->call.arguments.size;
+	bool method = node->call.callee->type == AST_PROPERTY;
+
+	uint8_t callee = reg_alloc(rc);
+	for (size_t i = 0; i < argc; ++i)
+		reg_expression(rc, *(ast_node_t**)buffer_at(&node->call.arguments, argc - i - 1), scope, reg_alloc(rc));
+
+	if (method) {
+		// The receiver is passed after the arguments, see OP_GETP
+		ast_node_t* property = node->call.callee;
+		uint8_t this = reg_alloc(rc);
+		reg_expression(rc, property->property.lhs, scope, this);
+		reg_emit(rc, ROP_GETP, callee, this, reg_operand_fits(rc, add_inline_cache(rc->vm, rc->fn)));
+		reg_emit_bx(rc, ROP_EXTRA, 0, add_constant(rc->vm, rc->fn, VALUE_OBJECT(new_string(rc->vm, property->property.name))));
+	} else {
+		reg_expression(rc, node->call.callee, scope, callee);
+	}
+
+	reg_emit(rc, ROP_CALL, callee, reg_operand_fits(rc, argc), method);
+	if (dest != callee)
+		reg_emit(rc, ROP_MOVE, dest, callee, 0);
+	rc->top = top;
+}
+
+static void reg_function(reg_compiler_t* rc, ast_node_t* node, scope_t* scope, uint8_t dest);
+
+static void reg_expression(reg_compiler_t* rc, ast_node_t* node, scope_t* scope, uint8_t dest)
+{
+	switch (node->type) {
+	case AST_BINARY: {
+		size_t top = rc->top;
+		uint8_t rhs = reg_operand(rc, node->binary.rhs, scope);
+		uint8_t lhs = reg_operand(rc, node->binary.lhs, scope);
+		reg_emit(rc, reg_binary_op(node->binary.operator), dest, lhs, rhs);
+		rc->top = top;
+	}	break;
+	case AST_BLOCK: {
+		// Nested scopes number their locals from 0 as well
+		size_t top = rc->top;
+		if (rc->top < node->block.scope->locals.size) {
+			rc->top = node->block.scope->locals.size;
+			if (rc->top > rc->fn->compiled.max_stack)
+				rc->fn->compiled.max_stack = rc->top;
+		}
+		buffer_foreach(node->block.body, ast_node_t*, child) {
+			size_t statement_top = rc->top;
+			reg_expression(rc, *child, node->block.scope, reg_alloc(rc));
+			rc->top = statement_top;
+		}
+		reg_op_t* last = rc->fn->compiled.code.size ? buffer_last(&rc->fn->compiled.code) : NULL;
+		if (!last || last->op != ROP_RETURN)
+			reg_emit(rc, ROP_RETURN, 0, 0, 0);
+		rc->top = top;
+	}	break;
+	case AST_BRANCH: {
+		size_t top = rc->top;
+		uint8_t condition = reg_operand(rc, node->branch.condition, scope);
+		rc->top = top;
+		size_t if_jump = rc->fn->compiled.code.size;
+		reg_emit_bx(rc, ROP_JUMP_IF, condition, 0);
+		reg_expression(rc, node->branch.consequent, scope, dest);
+		size_t else_jump = rc->fn->compiled.code.size;
+		reg_emit_bx(rc, ROP_JUMP, 0, 0);
+		reg_patch_jump(rc, if_jump);
+		if (node->branch.alternate)
+			reg_expression(rc, node->branch.alternate, scope, dest);
+		else
+			reg_emit(rc, ROP_LOADNULL, dest, 0, 0);
+		reg_patch_jump(rc, else_jump);
+	}	break;
+	case AST_CALL:
+		reg_call(rc, node, scope, dest);
+		break;
+	case AST_FUNCTION:
+		reg_function(rc, node, scope, dest);
+		break;
+	case AST_IDENTIFIER: {
+		size_t index = scope_find_local(scope, &node->identifier.token);
+		if (index == NOT_FOUND) {
+			reg_emit_bx(rc, ROP_GETG, dest, vm_global_slot(rc->vm, VALUE_OBJECT(new_string(rc->vm, node->identifier.name))));
+		} else if ((index & UPVALUE_MASK) == UPVALUE_MASK) {
+			reg_emit(rc, ROP_GETUP, dest, reg_operand_fits(rc, index & ~UPVALUE_MASK), 0);
+		} else if (index != dest) {
+			reg_emit(rc, ROP_MOVE, dest, index, 0);
+		}
+	}	break;
+	case AST_LITERAL: {
+		switch (node->literal.type) {
+		case TOKEN_NULL: reg_emit(rc, ROP_LOADNULL, dest, 0, 0); break;
+		case TOKEN_FALSE: reg_emit(rc, ROP_LOADBOOL, dest, 0, 0); break;
+		case TOKEN_TRUE: reg_emit(rc, ROP_LOADBOOL, dest, 1, 0); break;
+		case TOKEN_NUMBER:
+			reg_emit_bx(rc, ROP_LOADK, dest, add_constant(rc->vm, rc->fn, VALUE_NUMBER(node->literal.lit.number)));
+			break;
+		case TOKEN_STRING:
+			reg_emit_bx(rc, ROP_LOADK, dest, add_constant(rc->vm, rc->fn, VALUE_OBJECT(new_string_length(rc->vm, node->literal.lit.string.start, node->literal.lit.string.length))));
+			break;
+		default: break;
+		}
+	}	break;
+	case AST_PROPERTY: {
+		// TODO: implement ?.
+		size_t top = rc->top;
+		uint8_t this = reg_operand(rc, node->property.lhs, scope);
+		reg_emit(rc, ROP_GETP, dest, this, reg_operand_fits(rc, add_inline_cache(rc->vm, rc->fn)));
+		reg_emit_bx(rc, ROP_EXTRA, 0, add_constant(rc->vm, rc->fn, VALUE_OBJECT(new_string(rc->vm, node->property.name))));
+		rc->top = top;
+	}	break;
+	case AST_RETURN:
+		if (node->ret.expression) {
+			size_t top = rc->top;
+			reg_emit(rc, ROP_RETURN, reg_operand(rc, node->ret.expression, scope), 1, 0);
+			rc->top = top;
+		} else {
+			reg_emit(rc, ROP_RETURN, 0, 0, 0);
+		}
+		break;
+	case AST_UNARY: printf("AST_UNARY\n");
+		break;
+	case AST_VAR_DECL: {
+		size_t index = scope_find_local(scope, &node->var.identifier);
+		assert(index != UPVALUE_MASK);
+		reg_expression(rc, node->var.initializer, scope, reg_operand_fits(rc, index));
+	}	break;
+	}
+}
+
+static void reg_function(reg_compiler_t* rc, ast_node_t* node, scope_t* scope, uint8_t dest)
+{
+	function_t* inner_fn = new_function(rc->vm, node->function.parameters.size);
+	// Referenced from the enclosing function before anything else is allocated
+	size_t index = add_constant(rc->vm, rc->fn, VALUE_OBJECT(inner_fn));
+	reg_compiler_t inner = { .vm = rc->vm, .fn = inner_fn, .top = 0, .failed = rc->failed };
+	reg_expression(&inner, node->function.body, scope, 0);
+	rc->failed = inner.failed;
+
+	reg_emit_bx(rc, ROP_LOADK, dest, index);
+	scope_t* fn_scope = node->function.body->block.scope;
+	if (fn_scope->upvalues.size > 0) {
+		size_t top = rc->top;
+		size_t first = rc->top;
+		for (size_t i = 0; i < fn_scope->upvalues.size; ++i) {
+			size_t index = scope_find_local(scope, buffer_at(&fn_scope->upvalues, i));
+			uint8_t reg = reg_alloc(rc);
+			if ((index & UPVALUE_MASK) == UPVALUE_MASK)
+				reg_emit(rc, ROP_GETUP, reg, reg_operand_fits(rc, index & ~UPVALUE_MASK), 0);
+			else
+				reg_emit(rc, ROP_MOVE, reg, reg_operand_fits(rc, index), 0);
+		}
+		reg_emit(rc, ROP_CLOSE, dest, reg_operand_fits(rc, first), reg_operand_fits(rc, fn_scope->upvalues.size));
+		rc->top = top;
+	}
+}
+
+static bool compile_registers(vm_t* vm, function_t* fn, ast_node_t* root, scope_t* scope)
+{
+	reg_compiler_t rc = { .vm = vm, .fn = fn, .top = 0, .failed = false };
+	reg_expression(&rc, root, scope, 0);
+	return !rc.failed;
+}
@@ -0,0 +1,184 @@
+// Fuses the most common instruction sequences into single instructions, saving
+// dispatches and stack traffic in hot loops and calls.
+
+static inline bool is_jump(op_code_t op)
+{
+	switch (op) {
+	case OP_JUMP: case OP_JUMP_IF:
+	case OP_EQ_JUMP_IF: case OP_NEQ_JUMP_IF:
+	case OP_LT_JUMP_IF: case OP_LTE_JUMP_IF: case OP_GT_JUMP_IF: case OP_GTE_JUMP_IF:
+	case OP_LT_LL_JUMP_IF: case OP_LTE_LL_JUMP_IF: case OP_GT_LL_JUMP_IF: case OP_GTE_LL_JUMP_IF:
+	case OP_LT_LK_JUMP_IF: case OP_LTE_LK_JUMP_IF: case OP_GT_LK_JUMP_IF: case OP_GTE_LK_JUMP_IF:
+		return true;
+	default: return false;
+	}
+}
+
+static inline bool fits_operand(int32_t arg) {
+	return arg >= 0 && arg <= 0xFF;
+}
+
+// LOAD a; LOAD b; <op>
+static op_code_t fused_locals(op_code_t op)
+{
+	switch (op) {
+	case OP_ADD: return OP_ADD_LL;
+	case OP_SUB: return OP_SUB_LL;
+	case OP_MUL: return OP_MUL_LL;
+	case OP_DIV: return OP_DIV_LL;
+	default: return OP_NOP;
+	}
+}
+
+// PUSH_CONST k; LOAD a; <op>
+static op_code_t fused_constant(op_code_t op)
+{
+	switch (op) {
+	case OP_ADD: return OP_ADD_LK;
+	case OP_SUB: return OP_SUB_LK;
+	case OP_MUL: return OP_MUL_LK;
+	case OP_DIV: return OP_DIV_LK;
+	case OP_LT: return OP_LT_LK;
+	case OP_LTE: return OP_LTE_LK;
+	case OP_GT: return OP_GT_LK;
+	case OP_GTE: return OP_GTE_LK;
+	default: return OP_NOP;
+	}
+}
+
+// <op>; JUMP_IF
+static op_code_t fused_branch(op_code_t op)
+{
+	switch (op) {
+	case OP_EQ: return OP_EQ_JUMP_IF;
+	case OP_NEQ: return OP_NEQ_JUMP_IF;
+	case OP_LT: return OP_LT_JUMP_IF;
+	case OP_LTE: return OP_LTE_JUMP_IF;
+	case OP_GT: return OP_GT_JUMP_IF;
+	case OP_GTE: return OP_GTE_JUMP_IF;
+	default: return OP_NOP;
+	}
+}
+
+// LOAD a; LOAD b; <op>; JUMP_IF
+static op_code_t fused_locals_branch(op_code_t op)
+{
+	switch (op) {
+	case OP_LT: return OP_LT_LL_JUMP_IF;
+	case OP_LTE: return OP_LTE_LL_JUMP_IF;
+	case OP_GT: return OP_GT_LL_JUMP_IF;
+	case OP_GTE: return OP_GTE_LL_JUMP_IF;
+	default: return OP_NOP;
+	}
+}
+
+// PUSH_CONST k; LOAD a; <op>; JUMP_IF
+static op_code_t fused_constant_branch(op_code_t op)
+{
+	switch (op) {
+	case OP_LT: return OP_LT_LK_JUMP_IF;
+	case OP_LTE: return OP_LTE_LK_JUMP_IF;
+	case OP_GT: return OP_GT_LK_JUMP_IF;
+	case OP_GTE: return OP_GTE_LK_JUMP_IF;
+	default: return OP_NOP;
+	}
+}
+
+// Match a fusable sequence at code[i] and return its length. Instructions
+// other than the first one cannot be fused if something jumps to them.
+static size_t match_superinstruction(op_t* code, size_t size, bool* targets, size_t i, op_t* out)
+{
+	op_t* a = &code[i];
+	op_t* b = i + 1 < size && !targets[i + 1] ? &code[i + 1] : NULL;
+	op_t* c = b && i + 2 < size && !targets[i + 2] ? &code[i + 2] : NULL;
+	op_t* d = c && i + 3 < size && !targets[i + 3] ? &code[i + 3] : NULL;
+	op_code_t op;
+
+	// Longest sequences first, a compare-and-branch would otherwise lose its
+	// jump to the fused comparison
+	if (d && d->op == OP_JUMP_IF && a->op == OP_PUSH_CONST && b->op == OP_LOAD
+	 && fits_operand(a->arg) && fits_operand(b->arg) && (op = fused_constant_branch(c->op)) != OP_NOP) {
+		*out = (op_t){ op, d->arg, OP_ARGS(a->arg, b->arg) };
+		return 4;
+	}
+	if (d && d->op == OP_JUMP_IF && a->op == OP_LOAD && b->op == OP_LOAD
+	 && fits_operand(a->arg) && fits_operand(b->arg) && (op = fused_locals_branch(c->op)) != OP_NOP) {
+		*out = (op_t){ op, d->arg, OP_ARGS(a->arg, b->arg) };
+		return 4;
+	}
+	if (c && a->op == OP_PUSH_CONST && b->op == OP_LOAD && fits_operand(a->arg) && fits_operand(b->arg)
+	 && (op = fused_constant(c->op)) != OP_NOP) {
+		*out = (op_t){ op, OP_ARGS(a->arg, b->arg), 0 };
+		return 3;
+	}
+	if (c && a->op == OP_LOAD && b->op == OP_LOAD && fits_operand(a->arg) && fits_operand(b->arg)
+	 && (op = fused_locals(c->op)) != OP_NOP) {
+		*out = (op_t){ op, OP_ARGS(a->arg, b->arg), 0 };
+		return 3;
+	}
+	if (b && b->op == OP_JUMP_IF && (op = fused_branch(a->op)) != OP_NOP) {
+		*out = (op_t){ op, b->arg, 0 };
+		return 2;
+	}
+	if (b && a->op == OP_GETP && b->op == OP_CALL && fits_operand(a->arg) && fits_operand(b->arg)) {
+		*out = (op_t){ OP_INVOKE, OP_ARGS(a->arg, b->arg), 0 };
+		return 2;
+	}
+
+	*out = *a;
+	return 1;
+}
+
+static void fuse_superinstructions(function_t* fn)
+{
+	op_t* code = fn->compiled.code.data;
+	size_t size = fn->compiled.code.size;
+	if (size == 0)
+		return;
+
+	bool* targets = ALLOC((size + 1) * sizeof(bool));
+	size_t* new_index = ALLOC((size + 1) * sizeof(size_t));
+	// The old instruction holding the offset of every new jump
+	size_t* jump_origin = ALLOC(size * sizeof(size_t));
+	buffer_t fused = buffer_new(sizeof(op_t));
+	if (!targets || !new_index || !jump_origin)
+		goto unfused;
+
+	for (size_t i = 0; i < size; ++i)
+		if (is_jump(code[i].op))
+			targets[i + code[i].arg] = true;
+
+	for (size_t i = 0; i < size;) {
+		op_t op;
+		size_t length = match_superinstruction(code, size, targets, i, &op);
+		for (size_t j = 0; j < length; ++j)
+			new_index[i + j] = fused.size;
+		jump_origin[fused.size] = i + length - 1;
+		if (!buffer_push(&fused, &op))
+			goto unfused;
+		i += length;
+	}
+	new_index[size] = fused.size;
+
+	for (size_t i = 0; i < fused.size; ++i) {
+		op_t* op = buffer_at(&fused, i);
+		if (is_jump(op->op)) {
+			size_t origin = jump_origin[i];
+			op->arg = new_index[origin + code[origin].arg] - i;
+		}
+	}
+
+	buffer_free(&fn->compiled.code);
+	fn->compiled.code = fused;
+	FREE(targets);
+	FREE(new_index);
+	FREE(jump_origin);
+	return;
+
+	// Out of memory, the code is left unfused
+unfused:
+	buffer_free(&fused);
+	FREE(targets);
+	FREE(new_index);
+	FREE(jump_origin);
+}
@@ -3,31 +3,16 @@
 #include "vm.h"
 
 static const char* op_names[] = {
-#define __ENUMERATE(op) #op,
+#define __ENUMERATE(op, operands) #op,
 	__ENUMERATE_OP_CODES
 #undef __ENUMERATE
 };
 
-static inline bool op_has_arg(op_code_t op) {
-	switch (op) {
-		case OP_PUSH:
-		case OP_PUSH_CONST:
-		case OP_LOAD:
-		case OP_STORE:
-		case OP_LOAD_UP:
-		case OP_STORE_UP:
-		case OP_CLOSE:
-		case OP_CALL:
-		case OP_RETURN:
-		case OP_JUMP:
-		case OP_JUMP_IF:
-		case OP_MAKE_ARRAY:
-		case OP_MAKE_TABLE:
-			return true;
-		default: break;
-	}
-	return false;
-}
+static const char* reg_op_names[] = {
+#define __ENUMERATE(op) #op,
+	__ENUMERATE_REG_OP_CODES
+#undef __ENUMERATE
+};
 
 #define iprintf(indent, fmt, ...) printf("%*s" fmt, indent * 2, "", ##__VA_ARGS__)
 
@@ -39,7 +24,7 @@ static void dump_object(object_t* obj, int indent)
 	case OBJECT_ARRAY: {
 		array_t* array = (array_t*) obj;
 		iprintf(indent, "Array (%zu) {\n", array->values.size);
-		buffer_foreach(array->values, value_t, it)
+		vector_foreach(array->values, it)
 			dump(*it, indent + 1);
 		iprintf(indent, "}\n");
 	} break;
@@ -53,14 +38,25 @@ static void dump_object(object_t* obj, int indent)
 			printf("{\n");
 			for (size_t i = 0; i < function->compiled.constants.size; ++i) {
 				iprintf(indent + 1, "+ %zu ", i);
-				dump(*(value_t*)buffer_at(&function->compiled.constants, i), indent + 1);
+				dump(function->compiled.constants.data[i], indent + 1);
+			}
+			for (size_t i = 0; function->compiled.registers && i < function->compiled.code.size; ++i) {
+				reg_op_t* op = buffer_at(&function->compiled.code, i);
+				iprintf(indent + 1, "> %04zu %-12s%u, %u, %u (%d)\n", i, reg_op_names[op->op], op->a, op->b, op->c, op->bx);
 			}
-			for (size_t i = 0; i < function->compiled.code.size; ++i) {
-				op_t* op = buffer_at(&function->compiled.code, i);
-				iprintf(indent + 1, "> %04zu %-12s", i, op_names[op->op]);
-				if (op_has_arg(op->op))
-					printf("%d", op->arg);
+			const uint8_t* code = function->compiled.code.data;
+			for (size_t i = 0; !function->compiled.registers && i < function->compiled.code.size;) {
+				op_t op;
+				const uint8_t* at = op_decode(code + i, &op);
+				iprintf(indent + 1, "> %04zu %-16s", i, op_names[op.op]);
+				if (op_operands(op.op) == 1)
+					printf("%d", op.arg);
+				else if (op_operands(op.op) == 2)
+					printf("%u, %u", OP_ARG_A(op.arg), OP_ARG_B(op.arg));
+				else if (op_operands(op.op) == 3)
+					printf("%d, %u, %u", op.arg, OP_ARG_A(op.bytes), OP_ARG_B(op.bytes));
 				printf("\n");
+				i = at + op_length(op.op) - code;
 			}
 			iprintf(indent, "}\n");
 		}
@@ -81,7 +77,7 @@ static void dump_object(object_t* obj, int indent)
 		table_t* table = (table_t*) obj;
 		iprintf(indent, "Table {\n");
 		for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
-			buffer_foreach(table->buckets[i], table_pair_t, p) {
+			vector_foreach(table->buckets[i], p) {
 				dump(p->key, indent + 1);
 				iprintf(indent + 2, "=> ");
 				dump(p->value, 0);
@@ -1,67 +1,197 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 #include "vm.h"
 
-void vm_free(vm_t* vm, object_t* obj)
+// Releases what `obj` owns, it is called on every object before its block is
+// reused
+void vm_finalize(void* data, void* block)
 {
+	vm_t* vm = data;
+	object_t* obj = block;
+	size_t size = object_size(obj);
+	vm->gc_allocated -= size;
+	vm->gc_buffer_bytes -= object_buffers_size(obj);
+	vm->gc_freed++;
+	vm->gc_stats.objects[obj->type]--;
+	vm->gc_stats.bytes[obj->type] -= size;
+	vm->gc_stats.freed_objects++;
+	vm->gc_stats.freed_bytes += size;
+
 	switch (obj->type) {
-		case OBJECT_ARRAY: free_array((array_t*)obj); break;
-		case OBJECT_CLASS: free_class((class_t*)obj); break;
-		case OBJECT_FUNCTION: free_function((function_t*)obj); break;
-		case OBJECT_STRING: {
-			string_t* s = (string_t*)obj;
-			vm_string_pool_remove(&vm->string_pool, s);
-			free_string(s);
-		} break;
-		case OBJECT_TABLE: free_table((table_t*)obj); break;
+		case OBJECT_ARRAY: finalize_array((array_t*)obj); break;
+		case OBJECT_CLASS: finalize_class((class_t*)obj); break;
+		case OBJECT_FUNCTION: finalize_function((function_t*)obj); break;
+		case OBJECT_STRING: vm_string_pool_remove(&vm->string_pool, (string_t*)obj); break;
+		case OBJECT_TABLE: finalize_table(vm, (table_t*)obj); break;
 		default: break;
 	}
 }
 
-void vm_gc_keep_alive(vm_t* vm, object_t* obj)
+void vm_free(vm_t* vm, object_t* obj)
+{
+	size_t size = object_size(obj);
+	vm_finalize(vm, obj);
+	allocator_free(&vm->allocator, obj, size);
+}
+
+// `next_free` of the slots in use, which are not on the free list
+#define PIN_LIVE (SIZE_MAX - 1)
+
+// Keeps `value` alive until `vm_unpin` is called with the returned handle, in
+// any order
+vm_root_t vm_pin(vm_t* vm, value_t value)
+{
+	vm_root_t root = vm->gc_free_pin;
+	if (root == SIZE_MAX) {
+		if (!pin_vector_push(&vm->gc_pins, (gc_pin_t){ value, PIN_LIVE }))
+			vm_out_of_memory(vm);
+		return vm->gc_pins.size - 1;
+	}
+	vm->gc_free_pin = vm->gc_pins.data[root].next_free;
+	vm->gc_pins.data[root] = (gc_pin_t){ value, PIN_LIVE };
+	return root;
+}
+
+void vm_unpin(vm_t* vm, vm_root_t root)
+{
+	assert(root < vm->gc_pins.size);
+	// Unpinning twice would chain the slot into the free list twice
+	assert(vm->gc_pins.data[root].next_free == PIN_LIVE);
+	vm->gc_pins.data[root] = (gc_pin_t){ VALUE_NULL, vm->gc_free_pin };
+	vm->gc_free_pin = root;
+}
+
+// The pinned value, compaction may have moved it since it was pinned
+value_t vm_pinned(vm_t* vm, vm_root_t root)
 {
-	buffer_push(&vm->gc_roots, &obj);
+	assert(root < vm->gc_pins.size && vm->gc_pins.data[root].next_free == PIN_LIVE);
+	return vm->gc_pins.data[root].value;
 }
 
-void vm_gc_release(vm_t* vm, object_t* obj)
+// Handle scopes keep values alive without a handle to release each of them:
+// `vm_handle` keeps a value alive until the scope that was innermost then is
+// closed. Native functions run in a scope of their own, and scopes left open
+// by an error are closed by `vm_protect`.
+size_t vm_open_handles(vm_t* vm)
 {
-	buffer_remove(&vm->gc_roots, obj);
+	return vm->gc_handles.size;
 }
 
-static void sweep(object_t* obj);
-static inline void sweep_value(value_t value) {
+void vm_handle(vm_t* vm, value_t value)
+{
+	if (!value_vector_push(&vm->gc_handles, value))
+		vm_out_of_memory(vm);
+}
+
+// Closes `scope` and any scope opened after it
+void vm_close_handles(vm_t* vm, size_t scope)
+{
+	vm->gc_handles.size = scope;
+}
+
+// Tri-color marking: white objects are unmarked, gray ones are marked and
+// waiting on `vm->gc_gray` for their references to be marked, black ones are
+// marked and done with. Every object is pushed and blackened at most once.
+// Mark bits are kept by the allocator, see include/vm/allocator.h.
+//
+// Markers push gray objects on their own worklist, which is `vm->gc_gray`
+// unless marking in parallel.
+typedef struct marker {
+	vm_t* vm;
+	buffer_t* gray;
+	// Other markers may race to mark the same objects
+	bool shared;
+	struct mark_pool* pool;
+	size_t work;
+} marker_t;
+
+// An object that cannot be pushed is left marked, see `rescan_heap`
+static void push_gray(marker_t* m, buffer_t* gray, object_t* obj)
+{
+	if (!buffer_push(gray, &obj))
+		__atomic_store_n(&m->vm->gc_gray_overflow, true, __ATOMIC_RELAXED);
+}
+
+static void mark(marker_t* m, object_t* obj)
+{
+	// Minor collections stop at old objects, they are live until the next
+	// major one
+	if (obj == NULL || (m->vm->gc_minor && allocator_is_old(obj)))
+		return;
+	if (m->shared) {
+		if (!allocator_mark_atomic(obj))
+			return;
+	} else {
+		if (allocator_is_marked(obj))
+			return;
+		allocator_mark(obj);
+	}
+	push_gray(m, m->gray, obj);
+}
+
+static inline void mark_value(marker_t* m, value_t value)
+{
 	if (IS_OBJECT(value))
-		sweep(AS_OBJECT(value));
+		mark(m, AS_OBJECT(value));
 }
 
-static void sweep(object_t* obj)
+static void mark_values(marker_t* m, value_vector_t* values)
 {
-	obj->gc_bit = 0;
+	vector_foreach(*values, it) {
+		mark_value(m, *it);
+	}
+}
+
+// Whether `value` is held weakly by a table with `weak` keys or values
+static inline bool is_weak(bool weak, value_t value)
+{
+	return weak && IS_OBJECT(value) && !IS_STRING(value);
+}
+
+// Mark everything `obj` refers to
+static void blacken(marker_t* m, object_t* obj)
+{
+	mark(m, (object_t*)obj->class);
 
 	switch (obj->type) {
-	case OBJECT_ARRAY: {
-		array_t* array = (array_t*)obj;
-		buffer_foreach(array->values, value_t, it) {
-			sweep_value(*it);
-		}
-	} break;
+	case OBJECT_ARRAY:
+		mark_values(m, &((array_t*)obj)->values);
+		break;
 	case OBJECT_CLASS: {
 		class_t* class = (class_t*)obj;
-		buffer_foreach(class->constants, value_t, it) {
-			sweep_value(*it);
-		}
-		sweep((object_t*)class->properties);
+		mark(m, (object_t*)class->name);
+		mark(m, (object_t*)class->super);
+		mark_values(m, &class->constants);
+		mark(m, (object_t*)class->properties);
 	} break;
 	case OBJECT_FUNCTION: {
 		function_t* fn = (function_t*)obj;
-		buffer_foreach(fn->compiled.constants, value_t, it) {
-			sweep_value(*it);
+		if (fn->type == FUNCTION_NATIVE)
+			break;
+		mark_values(m, &fn->compiled.constants);
+		mark_values(m, &fn->compiled.captures);
+		// Cached classes must outlive the cache, a new class allocated at the
+		// same address would hit it
+		buffer_foreach(fn->compiled.caches, inline_cache_t, cache) {
+			for (size_t i = 0; i < INLINE_CACHE_SIZE; ++i) {
+				mark(m, (object_t*)cache->entries[i].class);
+				mark_value(m, cache->entries[i].value);
+			}
 		}
 	} break;
 	case OBJECT_TABLE: {
 		table_t* table = (table_t*)obj;
+		// Minor collections do not clear weak tables
+		uint8_t mode = m->vm->gc_minor ? TABLE_STRONG : table->mode;
 		for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
-			buffer_foreach(table->buckets[i], table_pair_t, pair) {
-				sweep_value(pair->key);
-				sweep_value(pair->value);
+			vector_foreach(table->buckets[i], pair) {
+				if (is_weak(mode & TABLE_WEAK_KEYS, pair->key))
+					continue;
+				mark_value(m, pair->key);
+				if (!is_weak(mode & TABLE_WEAK_VALUES, pair->value))
+					mark_value(m, pair->value);
 			}
 		}
 	} break;
@@ -70,30 +200,598 @@ static void sweep(object_t* obj)
 	}
 }
 
-unsigned vm_gc_collect(vm_t* vm)
+static inline marker_t serial_marker(vm_t* vm)
+{
+	return (marker_t){ .vm = vm, .gray = &vm->gc_gray };
+}
+
+void vm_gc_shade(vm_t* vm, object_t* obj)
+{
+	marker_t m = serial_marker(vm);
+	mark(&m, obj);
+}
+
+void vm_gc_remember(vm_t* vm, object_t* obj)
+{
+	if (!buffer_push(&vm->gc_remembered, &obj)) {
+		vm->gc_remembered_overflow = true;
+		return;
+	}
+	obj->gc_remembered = true;
+}
+
+static void forget_remembered(vm_t* vm)
+{
+	buffer_foreach(vm->gc_remembered, object_t*, obj) {
+		(*obj)->gc_remembered = false;
+	}
+	vm->gc_remembered.size = 0;
+}
+
+// Gray objects markers hand over to each other when marking in parallel. A
+// marker whose worklist grows while others are idle moves half of it here,
+// markers that run out take from here or wait. Marking is over once all of
+// them are waiting.
+typedef struct mark_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	buffer_t* gray;
+	size_t markers, idle;
+} mark_pool_t;
+
+// Gray objects a marker keeps before sharing them with idle ones
+#define MARK_SHARE_THRESHOLD 64
+// Most gray objects taken from the pool at once
+#define MARK_BATCH 256
+
+static void share(marker_t* m)
+{
+	mark_pool_t* pool = m->pool;
+	pthread_mutex_lock(&pool->lock);
+	// The oldest half, closer to the roots it likely leads to more objects
+	size_t half = m->gray->size / 2;
+	for (size_t i = 0; i < half; ++i)
+		push_gray(m, pool->gray, *(object_t**)buffer_at(m->gray, i));
+	buffer_splice(m->gray, 0, half);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static bool refill(marker_t* m)
 {
-	// Mark all objects for collection
-	for (object_t* cur = vm->heap; cur != NULL; cur = cur->next) {
-		cur->gc_bit = 1;
+	mark_pool_t* pool = m->pool;
+	pthread_mutex_lock(&pool->lock);
+	__atomic_add_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+	while (pool->gray->size == 0 && pool->idle < pool->markers)
+		pthread_cond_wait(&pool->wake, &pool->lock);
+
+	bool found = pool->gray->size > 0;
+	if (found) {
+		__atomic_sub_fetch(&pool->idle, 1, __ATOMIC_RELAXED);
+		size_t n = pool->gray->size < MARK_BATCH ? pool->gray->size : MARK_BATCH;
+		for (size_t i = pool->gray->size - n; i < pool->gray->size; ++i)
+			push_gray(m, m->gray, *(object_t**)buffer_at(pool->gray, i));
+		pool->gray->size -= n;
+	} else {
+		pthread_cond_broadcast(&pool->wake);
 	}
+	pthread_mutex_unlock(&pool->lock);
+	return found;
+}
+
+static void* run_marker(void* arg)
+{
+	marker_t* m = arg;
+	do {
+		while (m->gray->size > 0) {
+			object_t* obj = *(object_t**)buffer_last(m->gray);
+			m->gray->size--;
+			blacken(m, obj);
+			m->work++;
+			if (m->gray->size >= MARK_SHARE_THRESHOLD && __atomic_load_n(&m->pool->idle, __ATOMIC_RELAXED) > 0)
+				share(m);
+		}
+	} while (refill(m));
+	return NULL;
+}
 
-	// Un-mark root objects
-	buffer_foreach(vm->gc_roots, object_t*, obj) {
-		sweep(*obj);
+// Traces from `vm->gc_gray` with `vm->gc_mark_threads` helpers. The program is
+// stopped meanwhile, so objects are only read. Markers that could not be
+// started are done without, and nothing is traced if they cannot be allocated.
+static size_t trace_in_parallel(vm_t* vm)
+{
+	size_t count = vm->gc_mark_threads + 1;
+	marker_t* markers = ALLOC(count * sizeof(marker_t));
+	buffer_t* grays = ALLOC(count * sizeof(buffer_t));
+	pthread_t* threads = ALLOC(count * sizeof(pthread_t));
+	if (!markers || !grays || !threads) {
+		FREE(threads);
+		FREE(grays);
+		FREE(markers);
+		return 0;
+	}
+
+	mark_pool_t pool = { .gray = &vm->gc_gray };
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.wake, NULL);
+	for (size_t i = 0; i < count; ++i) {
+		grays[i] = buffer_new(sizeof(object_t*));
+		markers[i] = (marker_t){ .vm = vm, .gray = &grays[i], .shared = true, .pool = &pool };
+	}
+
+	// Helpers wait on the lock until they are all counted
+	pthread_mutex_lock(&pool.lock);
+	size_t started = 1;
+	for (; started < count; ++started) {
+		if (pthread_create(&threads[started], NULL, run_marker, &markers[started]) != 0)
+			break;
+	}
+	pool.markers = started;
+	pthread_mutex_unlock(&pool.lock);
+
+	run_marker(&markers[0]);
+	size_t work = markers[0].work;
+	for (size_t i = 1; i < started; ++i) {
+		pthread_join(threads[i], NULL);
+		work += markers[i].work;
 	}
 
-	// Now free the non-root objects
-	unsigned collected = 0;
-	for (object_t** cur = &vm->heap; *cur != NULL; ) {
-		if ((*cur)->gc_bit == 1) {
-			object_t* next = (*cur)->next;
-			vm_free(vm, *cur);
-			*cur = next;
-			collected++;
+	for (size_t i = 0; i < count; ++i)
+		buffer_free(&grays[i]);
+	FREE(threads);
+	FREE(grays);
+	FREE(markers);
+	pthread_cond_destroy(&pool.wake);
+	pthread_mutex_destroy(&pool.lock);
+	return work;
+}
+
+static void rescan_block(void* data, void* block)
+{
+	marker_t* m = data;
+	if (allocator_is_marked(block)) {
+		blacken(m, block);
+		m->work++;
+	}
+}
+
+// Marked objects that could not be pushed were never blackened. Without
+// knowing which they are, every marked object is blackened again: those of
+// the heap, or the young ones in minor collections.
+static void rescan_heap(marker_t* m)
+{
+	vm_t* vm = m->vm;
+	vm->gc_gray_overflow = false;
+	if (vm->gc_minor) {
+		for (object_t* obj = vm->young; obj; obj = obj->next)
+			rescan_block(m, obj);
+	} else {
+		allocator_foreach(&vm->allocator, rescan_block, m);
+	}
+}
+
+// Blacken gray objects until there are none left or `budget` is spent,
+// returns the work done
+static size_t trace_references(vm_t* vm, size_t budget)
+{
+	size_t work = 0;
+	if (budget == SIZE_MAX && vm->gc_mark_threads > 0 && !vm->gc_minor)
+		work = trace_in_parallel(vm);
+
+	marker_t m = serial_marker(vm);
+	for (;;) {
+		while (vm->gc_gray.size > 0 && m.work < budget) {
+			object_t* obj = *(object_t**)buffer_last(&vm->gc_gray);
+			vm->gc_gray.size--;
+			blacken(&m, obj);
+			m.work++;
+		}
+		if (vm->gc_gray.size > 0 || !vm->gc_gray_overflow)
+			break;
+		rescan_heap(&m);
+	}
+	return work + m.work;
+}
+
+// Everything the running program can reach starts from here: values kept
+// alive from C, the values on the VM stack, the functions being run, the
+// globals and the builtin classes.
+static void mark_roots(vm_t* vm)
+{
+	marker_t m = serial_marker(vm);
+	vector_foreach(vm->gc_pins, pin) {
+		mark_value(&m, pin->value);
+	}
+	vector_foreach(vm->gc_handles, it) {
+		mark_value(&m, *it);
+	}
+
+	for (value_t* it = vm->stack; it < vm->sp; ++it)
+		mark_value(&m, *it);
+
+	for (size_t i = 0; i < vm->frame_count; ++i)
+		mark(&m, (object_t*)vm->frames[i].callee);
+
+	buffer_foreach(vm->global_slots, global_slot_t, slot) {
+		mark_value(&m, slot->name);
+		mark_value(&m, slot->value);
+	}
+
+	mark(&m, (object_t*)vm->array_class);
+	mark(&m, (object_t*)vm->bool_class);
+	mark(&m, (object_t*)vm->function_class);
+	mark(&m, (object_t*)vm->number_class);
+	mark(&m, (object_t*)vm->string_class);
+	mark(&m, (object_t*)vm->table_class);
+}
+
+// Marks the values of the live weak tables whose keys are marked, until no
+// more are. Returns whether any was.
+static bool mark_ephemerons(vm_t* vm)
+{
+	marker_t m = serial_marker(vm);
+	size_t gray = vm->gc_gray.size;
+	buffer_foreach(vm->gc_weak_tables, table_t*, it) {
+		table_t* table = *it;
+		if (!(table->mode & TABLE_WEAK_KEYS) || !allocator_is_marked(table))
+			continue;
+		for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
+			vector_foreach(table->buckets[i], pair) {
+				if (is_weak(true, pair->key) && allocator_is_marked(AS_OBJECT(pair->key))
+					&& !is_weak(table->mode & TABLE_WEAK_VALUES, pair->value))
+					mark_value(&m, pair->value);
+			}
+		}
+	}
+	return vm->gc_gray.size > gray || vm->gc_gray_overflow;
+}
+
+static bool is_dead(bool weak, value_t value)
+{
+	return is_weak(weak, value) && !allocator_is_marked(AS_OBJECT(value));
+}
+
+// Removes the pairs of live weak tables whose weak key or value is unmarked
+static void clear_weak_tables(vm_t* vm)
+{
+	buffer_foreach(vm->gc_weak_tables, table_t*, it) {
+		table_t* table = *it;
+		if (!allocator_is_marked(table))
+			continue;
+		for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
+			pair_vector_t* bucket = &table->buckets[i];
+			for (size_t j = bucket->size; j-- > 0; ) {
+				table_pair_t* pair = &bucket->data[j];
+				if (is_dead(table->mode & TABLE_WEAK_KEYS, pair->key)
+					|| is_dead(table->mode & TABLE_WEAK_VALUES, pair->value)) {
+					pair_vector_remove(bucket, j);
+					table->version++;
+				}
+			}
+		}
+	}
+}
+
+// A cycle clears the marks and marks the roots, then traces from them in
+// slices interleaved with the program. Roots are written to without barriers,
+// so once no gray object is left they are marked again and traced in one go,
+// along with the values of weak tables whose keys were marked. The pairs of
+// weak tables left unmarked are cleared.
+// Finally, the allocator sweeps the objects that existed when marking ended:
+// unmarked ones are freed, the others are old from then on. Objects allocated
+// during the cycle are marked until sweeping starts, and are only given swept
+// blocks after.
+static size_t step(vm_t* vm, size_t budget)
+{
+	size_t work = 0;
+	switch (vm->gc_phase) {
+	case GC_IDLE:
+		vm->gc_freed = 0;
+		allocator_clear_marks(&vm->allocator);
+		mark_roots(vm);
+		vm->gc_phase = GC_MARK;
+		break;
+	case GC_MARK:
+		work = trace_references(vm, budget);
+		if (vm->gc_gray.size > 0)
+			break;
+		mark_roots(vm);
+		work += trace_references(vm, SIZE_MAX);
+		while (mark_ephemerons(vm))
+			work += trace_references(vm, SIZE_MAX);
+		clear_weak_tables(vm);
+		// Every survivor is about to be old
+		forget_remembered(vm);
+		vm->gc_remembered_overflow = false;
+		vm->young = NULL;
+		vm->gc_young_allocated = 0;
+		allocator_start_sweep(&vm->allocator);
+		vm->gc_phase = GC_SWEEP;
+		break;
+	case GC_SWEEP:
+		work = allocator_sweep(&vm->allocator, budget);
+		if (vm->allocator.unswept > 0)
+			break;
+		vm->gc_next = vm->gc_allocated * GC_GROWTH_FACTOR;
+		if (vm->gc_next < vm->gc_threshold)
+			vm->gc_next = vm->gc_threshold;
+		vm->gc_stats.major_collections++;
+		vm->gc_phase = GC_IDLE;
+		break;
+	}
+	return work;
+}
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Accounts for the time the program was stopped since `start`
+static uint64_t end_pause(vm_t* vm, uint64_t start)
+{
+	uint64_t pause = clock_ns() - start;
+	vm->gc_stats.total_pause += pause;
+	if (pause > vm->gc_stats.max_pause)
+		vm->gc_stats.max_pause = pause;
+	return pause;
+}
+
+static void trace(vm_t* vm, const char* kind, size_t count, unsigned freed, uint64_t pause)
+{
+	if (vm->gc_trace)
+		fprintf(stderr, "gc: %s collection %zu, freed %u objects, %zu bytes left, paused %.3f ms\n",
+			kind, count, freed, vm->gc_allocated, pause / 1e6);
+}
+
+// Major cycles are traced once over, with the time of all their steps
+static void end_major_pause(vm_t* vm, uint64_t start, size_t major_collections)
+{
+	vm->gc_cycle_pause += end_pause(vm, start);
+	if (vm->gc_stats.major_collections == major_collections)
+		return;
+	trace(vm, "major", vm->gc_stats.major_collections, vm->gc_freed, vm->gc_cycle_pause);
+	vm->gc_cycle_pause = 0;
+}
+
+// Without a budget marking stops the world, and sweeping is lazy: slabs are
+// swept when their size class runs out of blocks, and one more on every
+// allocation.
+void vm_gc_step(vm_t* vm)
+{
+	uint64_t start = clock_ns();
+	size_t major_collections = vm->gc_stats.major_collections;
+
+	if (vm->gc_step_work == 0) {
+		if (vm->gc_phase == GC_SWEEP) {
+			step(vm, 1);
+		} else {
+			do {
+				step(vm, SIZE_MAX);
+			} while (vm->gc_phase == GC_MARK);
+		}
+	} else {
+		size_t work = 0;
+		do {
+			work += step(vm, vm->gc_step_work - work);
+		} while (work < vm->gc_step_work && vm->gc_phase != GC_IDLE);
+	}
+
+	end_major_pause(vm, start, major_collections);
+}
+
+// Traces the young objects reachable from the roots and from the remembered
+// set, then promotes them and frees the others. It always stops the world, and
+// waits for major cycles to be over. Young objects are unmarked until then,
+// and old ones are never looked at. A major collection runs instead if some
+// object could not be remembered.
+unsigned vm_gc_collect_young(vm_t* vm)
+{
+	if (vm->gc_phase != GC_IDLE)
+		return 0;
+	if (vm->gc_remembered_overflow)
+		return vm_gc_collect(vm);
+
+	uint64_t start = clock_ns();
+	vm->gc_minor = true;
+	mark_roots(vm);
+	marker_t m = serial_marker(vm);
+	buffer_foreach(vm->gc_remembered, object_t*, obj) {
+		blacken(&m, *obj);
+	}
+	forget_remembered(vm);
+	trace_references(vm, SIZE_MAX);
+	vm->gc_minor = false;
+
+	unsigned freed = 0;
+	while (vm->young) {
+		object_t* obj = vm->young;
+		vm->young = obj->next;
+		if (!allocator_is_marked(obj)) {
+			vm_free(vm, obj);
+			freed++;
 		} else {
-			cur = &(*cur)->next;
+			allocator_set_old(obj);
 		}
 	}
+	vm->gc_young_allocated = 0;
+
+	vm->gc_stats.minor_collections++;
+	trace(vm, "minor", vm->gc_stats.minor_collections, freed, end_pause(vm, start));
+	return freed;
+}
 
-	return collected;
+// Collects if `size` more bytes do not fit under `gc_limit`, raises if they still do not
+void vm_gc_reserve(vm_t* vm, size_t size)
+{
+	if (vm->gc_limit == 0 || vm->gc_allocated + vm->gc_buffer_bytes + size <= vm->gc_limit)
+		return;
+
+	vm_gc_collect(vm);
+	if (vm->gc_allocated + vm->gc_buffer_bytes + size > vm->gc_limit)
+		vm_out_of_memory(vm);
+}
+
+// Runs a whole cycle, after finishing the one in progress if any
+unsigned vm_gc_collect(vm_t* vm)
+{
+	uint64_t start = clock_ns();
+	while (vm->gc_phase != GC_IDLE)
+		step(vm, SIZE_MAX);
+	size_t major_collections = vm->gc_stats.major_collections;
+	do {
+		step(vm, SIZE_MAX);
+	} while (vm->gc_phase != GC_IDLE);
+	end_major_pause(vm, start, major_collections);
+	return vm->gc_freed;
+}
+
+void vm_gc_stats(vm_t* vm, gc_stats_t* stats)
+{
+	*stats = vm->gc_stats;
+	stats->strings = vm->string_pool.count;
+	stats->string_tombstones = vm->string_pool.tombstones;
+	stats->string_buckets = vm->string_pool.capacity;
+}
+
+static inline void forward(object_t** obj)
+{
+	if (*obj)
+		*obj = allocator_forward(*obj);
+}
+
+// Returns whether it was moved
+static inline bool forward_value(value_t* value)
+{
+	if (!IS_OBJECT(*value))
+		return false;
+	object_t* obj = AS_OBJECT(*value);
+	*value = VALUE_OBJECT(allocator_forward(obj));
+	return AS_OBJECT(*value) != obj;
+}
+
+static void forward_values(value_vector_t* values)
+{
+	vector_foreach(*values, it) {
+		forward_value(it);
+	}
+}
+
+// Points the references of `obj` to where objects were moved. A full
+// collection just ran, so there are no young objects and `next` is unused.
+static void forward_references(void* data, void* block)
+{
+	vm_t* vm = data;
+	object_t* obj = block;
+	forward((object_t**)&obj->class);
+
+	switch (obj->type) {
+	case OBJECT_ARRAY:
+		forward_values(&((array_t*)obj)->values);
+		break;
+	case OBJECT_CLASS: {
+		class_t* class = (class_t*)obj;
+		forward((object_t**)&class->name);
+		forward((object_t**)&class->super);
+		forward_values(&class->constants);
+		forward((object_t**)&class->properties);
+	} break;
+	case OBJECT_FUNCTION: {
+		function_t* fn = (function_t*)obj;
+		if (fn->type == FUNCTION_NATIVE)
+			break;
+		forward_values(&fn->compiled.constants);
+		forward_values(&fn->compiled.captures);
+		buffer_foreach(fn->compiled.caches, inline_cache_t, cache) {
+			for (size_t i = 0; i < INLINE_CACHE_SIZE; ++i) {
+				forward((object_t**)&cache->entries[i].class);
+				forward_value(&cache->entries[i].value);
+			}
+		}
+	} break;
+	case OBJECT_TABLE: {
+		table_t* table = (table_t*)obj;
+		bool moved_keys = false;
+		for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
+			vector_foreach(table->buckets[i], pair) {
+				if (forward_value(&pair->key) && !IS_STRING(pair->key))
+					moved_keys = true;
+				forward_value(&pair->value);
+			}
+		}
+		if (moved_keys)
+			table_rehash(vm, table);
+	} break;
+	default:
+		break;
+	}
+}
+
+// Same roots as `mark_roots`, no function is running
+static void forward_roots(vm_t* vm)
+{
+	vector_foreach(vm->gc_pins, pin) {
+		forward_value(&pin->value);
+	}
+	vector_foreach(vm->gc_handles, it) {
+		forward_value(it);
+	}
+
+	for (value_t* it = vm->stack; it < vm->sp; ++it)
+		forward_value(it);
+
+	buffer_foreach(vm->global_slots, global_slot_t, slot) {
+		forward_value(&slot->name);
+		forward_value(&slot->value);
+	}
+
+	buffer_foreach(vm->gc_weak_tables, table_t*, table) {
+		forward((object_t**)table);
+	}
+
+	forward((object_t**)&vm->global);
+	forward((object_t**)&vm->global_slot_index);
+	forward((object_t**)&vm->array_class);
+	forward((object_t**)&vm->bool_class);
+	forward((object_t**)&vm->function_class);
+	forward((object_t**)&vm->number_class);
+	forward((object_t**)&vm->string_class);
+	forward((object_t**)&vm->table_class);
+	vm_string_pool_forward(&vm->string_pool);
+}
+
+// Collects, then moves objects out of the emptiest slabs of each size class
+// and releases them. Objects are only referred to from the VM and from each
+// other while no function runs, so it does nothing otherwise: C code must not
+// hold objects across it but through the stack or the roots. Returns the
+// slabs released.
+size_t vm_gc_compact(vm_t* vm)
+{
+	if (vm->frame_count > 0)
+		return 0;
+
+	vm_gc_collect(vm);
+	uint64_t start = clock_ns();
+	size_t released = allocator_evacuate(&vm->allocator);
+	if (released > 0) {
+		allocator_foreach(&vm->allocator, forward_references, vm);
+		forward_roots(vm);
+		allocator_release_evacuated(&vm->allocator);
+	}
+	vm->gc_stats.compactions++;
+	uint64_t pause = end_pause(vm, start);
+	if (vm->gc_trace)
+		fprintf(stderr, "gc: compaction %zu, released %zu slabs, paused %.3f ms\n",
+			vm->gc_stats.compactions, released, pause / 1e6);
+	return released;
+}
+
+// Called when no function is running
+void vm_gc_safepoint(vm_t* vm)
+{
+	if (vm->gc_compact_ratio > 0 && vm->gc_phase == GC_IDLE
+		&& allocator_fragmentation(&vm->allocator) >= vm->gc_compact_ratio)
+		vm_gc_compact(vm);
 }
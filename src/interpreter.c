@@ -1,15 +1,19 @@
 #include <assert.h>
+#include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include "jit/jit.h"
 #include "vm.h"
+#include "vm/interpreter.h"
 
 static const char* op_names[] = {
-#define __ENUMERATE(op) #op,
+#define __ENUMERATE(op, operands) #op,
 	__ENUMERATE_OP_CODES
 #undef __ENUMERATE
 };
 
-static void runtime_error(vm_t* vm, const char* error, ...)
+void runtime_error(vm_t* vm, const char* error, ...)
 {
 	char buf[128];
 	int c = snprintf(buf, sizeof(buf), "runtime error: ");
@@ -22,7 +26,7 @@ static void runtime_error(vm_t* vm, const char* error, ...)
 	vm->error_handler(buf);
 }
 
-static frame_t* push_frame(vm_t* vm, buffer_t* frames, value_t callable, uint8_t argc)
+frame_t* push_frame(vm_t* vm, value_t callable, uint8_t argc)
 {
 	if (!IS_FUNCTION(callable)) {
 		runtime_error(vm, "value is not callable");
@@ -36,39 +40,64 @@ static frame_t* push_frame(vm_t* vm, buffer_t* frames, value_t callable, uint8_t
 		return NULL;
 	}
 
-	frame_t frame;
-	frame.stack_start = vm->stack.size - argc;
-	if (vm->debug) printf("+++ STACK START IS %zu-%u\n", vm->stack.size, argc);
-	frame.callee = fn;
+	if (vm->frame_count == vm->max_frames) {
+		runtime_error(vm, "stack overflow");
+		return NULL;
+	}
 
-	// When the function is native, point to the instruction that called it, so the argc is available.
-	frame.ip = fn->type == FUNCTION_NATIVE ? ((frame_t*)buffer_last(frames))->ip : fn->compiled.code.data;
+	frame_t* frame = &vm->frames[vm->frame_count++];
+	frame->stack_start = vm->sp - vm->stack - argc;
+	if (vm->debug) printf("+++ STACK START IS %zu-%u\n", (size_t)(vm->sp - vm->stack), argc);
+	frame->callee = fn;
+	frame->ip = fn->compiled.code.data;
 
-	buffer_push(frames, &frame);
-	return buffer_last(frames);
+	// This is the only place the stack can overflow, handlers push without
+	// checking. Growing it may collect, `fn` is kept alive by its frame.
+	vm_ensure_stack(vm, fn->compiled.max_stack);
+	return frame;
 }
 
-static frame_t* pop_frame(vm_t* vm, buffer_t* frames, int8_t n_returned)
+frame_t* pop_frame(vm_t* vm, int8_t n_returned)
 {
 	value_t ret = n_returned ? vm_pop(vm) : VALUE_NULL;
 
-	frame_t* f = buffer_last(frames);
-	if (f) {
-		if (vm->debug) printf("--- STACK_START WAS %zu, RETURNED %d\n", f->stack_start, n_returned);
-
-		// Native functions will consume all arguments on the stackn thus no need to reset its size.
-		if (f->callee->type != FUNCTION_NATIVE) {
-			vm->stack.size = f->stack_start;
-		}
-	}
-	frames->size--;
+	frame_t* f = &vm->frames[--vm->frame_count];
+	if (vm->debug) printf("--- STACK_START WAS %zu, RETURNED %d\n", f->stack_start, n_returned);
+	vm->sp = vm->stack + f->stack_start;
 
 	if (n_returned) vm_push(vm, ret);
 
-	return buffer_last(frames);
+	return f - 1;
+}
+
+// Tail calls reuse the window of the current frame: the `argc` arguments on top
+// of the stack are moved down to its start, then the callee's frame is pushed
+// in its place.
+frame_t* replace_frame(vm_t* vm, value_t callable, uint8_t argc)
+{
+	frame_t* f = &vm->frames[--vm->frame_count];
+	memmove(vm->stack + f->stack_start, vm->sp - argc, argc * sizeof(value_t));
+	vm->sp = vm->stack + f->stack_start + argc;
+	return push_frame(vm, callable, argc);
+}
+
+// Native functions run to completion on the C stack, they never get a frame.
+// They consume their arguments and push their own return values, whose count
+// is returned, or -1 on error. Handles they make are released as they return.
+int8_t call_native(vm_t* vm, function_t* fn, uint8_t argc)
+{
+	if (argc < fn->arity) {
+		runtime_error(vm, "not enough arguments to run function, got %u instead of %u", argc, fn->arity);
+		return -1;
+	}
+
+	size_t scope = vm_open_handles(vm);
+	int8_t n_returned = fn->native(vm, argc);
+	vm_close_handles(vm, scope);
+	return n_returned;
 }
 
-static class_t* get_class(vm_t* vm, value_t value)
+class_t* get_class(vm_t* vm, value_t value)
 {
 	if (IS_NULL(value)) return NULL;
 	if (IS_BOOL(value)) return vm->bool_class;
@@ -83,310 +112,701 @@ static class_t* get_class(vm_t* vm, value_t value)
 	return NULL;
 }
 
+value_t get_property(vm_t* vm, function_t* fn, inline_cache_t* cache, class_t* class, value_t name)
+{
+	for (size_t i = 0; i < INLINE_CACHE_SIZE; ++i) {
+		if (cache->entries[i].class == class && cache->entries[i].version == class->properties->version)
+			return cache->entries[i].value;
+	}
+
+	value_t value = table_get(class->properties, name);
+	if (value == VALUE_NULL)
+		return value;
+
+	// Refresh the class' stale entry or take a free one, evict in turn otherwise
+	size_t i = 0;
+	while (i < INLINE_CACHE_SIZE && cache->entries[i].class != class && cache->entries[i].class != NULL)
+		++i;
+	if (i == INLINE_CACHE_SIZE)
+		i = cache->victim++ % INLINE_CACHE_SIZE;
+
+	vm_gc_barrier(vm, &fn->header, VALUE_OBJECT(class));
+	vm_gc_barrier(vm, &fn->header, value);
+	cache->entries[i].class = class;
+	cache->entries[i].version = class->properties->version;
+	cache->entries[i].value = value;
+	return value;
+}
+
+void vm_ensure_stack(vm_t* vm, size_t count)
+{
+	size_t size = vm->sp - vm->stack;
+	if (size + count <= vm->stack_capacity)
+		return;
+
+	size_t capacity = vm->stack_capacity;
+	while (size + count > capacity)
+		capacity *= 2;
+
+	size_t bytes = (capacity - vm->stack_capacity) * sizeof(value_t);
+	vm_gc_reserve(vm, bytes);
+	value_t* stack = REALLOC(vm->stack, capacity * sizeof(value_t));
+	if (!stack)
+		vm_out_of_memory(vm);
+	vm->stack = stack;
+	vm->sp = stack + size;
+	vm->stack_capacity = capacity;
+	vm->gc_buffer_bytes += bytes;
+}
+
 void vm_push(vm_t* vm, value_t value)
 {
-	if (vm->debug) { printf(">>> [%zu] ", vm->stack.size); value_dump(value); }
-	buffer_push(&vm->stack, &value);
+	if (vm->sp == vm->stack + vm->stack_capacity) {
+		// Growing the stack may collect
+		size_t scope = vm_open_handles(vm);
+		vm_handle(vm, value);
+		vm_ensure_stack(vm, 1);
+		vm_close_handles(vm, scope);
+	}
+	*vm->sp++ = value;
 }
 
 value_t vm_pop(vm_t* vm)
 {
-	value_t value = *(value_t*)buffer_last(&vm->stack);
-	vm->stack.size--;
-	if (vm->debug) printf("<<< [%zu]\n", vm->stack.size);
-	return value;
+	return *--vm->sp;
+}
+
+// Raises an error in the innermost `vm_protect`. The host must only allocate
+// through the VM's entry points or within `vm_protect`, as there is nothing to
+// catch the error with otherwise.
+void vm_out_of_memory(vm_t* vm)
+{
+	runtime_error(vm, "out of memory");
+	if (!vm->error_jump)
+		abort();
+	longjmp(*vm->error_jump, 1);
+}
+
+// Pushes to a buffer of the VM, raising an out of memory error if it is full
+// and cannot grow
+void vm_buffer_push(vm_t* vm, buffer_t* buf, void* element)
+{
+	if (!buffer_push(buf, element))
+		vm_out_of_memory(vm);
+}
+
+#include "interpreter/registers.c"
+
+// Runs `fn` so that the out of memory errors it raises unwind back here. The
+// frames it pushed, the values it left on the stack and the handle scopes it
+// opened are then dropped, and false is returned.
+bool vm_protect(vm_t* vm, vm_protected_t fn, void* data)
+{
+	jmp_buf* outer = vm->error_jump;
+	size_t stack_size = vm->sp - vm->stack;
+	size_t frame_count = vm->frame_count;
+	size_t handles = vm_open_handles(vm);
+	bool completed = true;
+	jmp_buf jump;
+	vm->error_jump = &jump;
+	if (setjmp(jump) == 0) {
+		fn(vm, data);
+	} else {
+		vm->sp = vm->stack + stack_size;
+		vm->frame_count = frame_count;
+		vm_close_handles(vm, handles);
+		completed = false;
+	}
+	vm->error_jump = outer;
+	return completed;
 }
 
-static value_t vm_peek(vm_t* vm)
+typedef struct call {
+	value_t callable;
+	uint8_t argc;
+} call_t;
+
+static void run_call(vm_t* vm, void* data)
 {
-	return *(value_t*)buffer_last(&vm->stack);
+	call_t* call = data;
+	if (is_native(call->callable)) {
+		call_native(vm, AS_FUNCTION(call->callable), call->argc);
+		return;
+	}
+
+	// Nested calls (e.g. from native functions) share the VM's call stack, this
+	// invocation is over when it unwinds back to `base`.
+	size_t base = vm->frame_count;
+	if (push_frame(vm, call->callable, call->argc))
+		interpret_frame(vm, base);
 }
 
 void vm_interpret(vm_t* vm, value_t callable, uint8_t argc)
 {
-	buffer_t frames = buffer_new(sizeof(frame_t));
-	frame_t* f = push_frame(vm, &frames, callable, argc);
-
-#define NEXT() f->ip++; goto start;
-
-start:
-	if (f) {
-		// Special handling for native functions
-		if (f->callee->type == FUNCTION_NATIVE) {
-			int8_t res = f->callee->native(vm, f->ip->arg);
-			f = pop_frame(vm, &frames, res);
-			if (f) f->ip++;
-			goto start;
-		}
+	// Out of memory errors drop the arguments along with the frames of this
+	// invocation, as any other error would
+	size_t start = vm->sp - vm->stack - argc;
+	call_t call = { callable, argc };
+	if (!vm_protect(vm, run_call, &call))
+		vm->sp = vm->stack + start;
 
-		if (vm->debug) printf("%p%*s %s %d\n", &frames, (int)frames.size * 2, "", op_names[f->ip->op], f->ip->arg);
+	// Back to the host, nothing refers to objects but the VM
+	if (vm->frame_count == 0)
+		vm_gc_safepoint(vm);
+}
 
-		switch (f->ip->op) {
+bool interpret_frame(vm_t* vm, size_t base)
+{
+	frame_t* f = &vm->frames[base];
+	if (f->callee->compiled.registers)
+		return interpret_registers(vm, base);
 
-		// Do nothing
-		case OP_NOP: {
-			NEXT();
-		}
-		// Push a number of null values on the stack
-		case OP_PUSH: {
-			for (int16_t i = 0; i < f->ip->arg; ++i) {
-				vm_push(vm, VALUE_NULL);
-			}
-			NEXT();
-		}
-		// Push a 'false' value
-		case OP_PUSH_FALSE: {
-			vm_push(vm, VALUE_FALSE);
-			NEXT();
-		}
-		// Push a 'true' value
-		case OP_PUSH_TRUE: {
-			vm_push(vm, VALUE_TRUE);
-			NEXT();
-		}
-		// Push a constant (number, string, instance...) value
-		case OP_PUSH_CONST: {
-			vm_push(vm, *(value_t*)buffer_at(&f->callee->compiled.constants, f->ip->arg));
-			NEXT();
-		}
-		// Load a value to the stack
-		case OP_LOAD: {
-			assert(vm->stack.capacity >= f->stack_start + f->ip->arg);
-			value_t* vp = &((value_t*)vm->stack.data)[f->stack_start + f->ip->arg];
-			vm_push(vm, *vp);
-			NEXT();
-		}
-		// Store a value from the stack
-		case OP_STORE: {
-			value_t v = vm_peek(vm);
-			assert(vm->stack.capacity >= f->stack_start + f->ip->arg);
-			value_t* vp = &((value_t*)vm->stack.data)[f->stack_start + f->ip->arg];
-			*vp = v;
-			NEXT();
-		}
-		// Load an upvalue to the stack
-		case OP_LOAD_UP: {
-			vm_push(vm, *(value_t*)buffer_at(&f->callee->compiled.captures, f->ip->arg));
-			NEXT();
-		}
-		// Store an upvalue from the stack
-		case OP_STORE_UP: {
-			*(value_t*)buffer_at(&f->callee->compiled.captures, f->ip->arg) = vm_pop(vm);
-			NEXT();
-		}
+	if (jit_ready(vm, f->callee)) {
+		if (jit_enter(vm, f))
+			return true;
+		goto error;
+	}
 
-#define BINARY_OP(name, op) case OP_ ## name: { \
-		value_t a = vm_pop(vm); \
-		value_t b = vm_pop(vm); \
-		if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
-			return runtime_error(vm, "operand of " #name " is not a Number"); \
-		value_t res = VALUE_NUMBER(AS_NUMBER(a) op AS_NUMBER(b)); \
-		vm_push(vm, res); \
-		NEXT(); \
+	// Cached copies of `vm->sp` and of the current frame's base. They must be
+	// written back before calling anything that touches the stack and reloaded
+	// afterwards, since the stack may have been reallocated.
+	value_t* sp = vm->sp;
+	value_t* slots = vm->stack + f->stack_start;
+	// Cached copy of the current frame's instruction pointer, written back
+	// before pushing a frame
+	uint8_t* ip = f->ip;
+	uint32_t arg;
+	uint8_t length;
+
+#if USE_COMPUTED_GOTO
+	static void* const op_labels[] = {
+#define __ENUMERATE(op, operands) &&op_ ## op,
+		__ENUMERATE_OP_CODES
+#undef __ENUMERATE
+	};
+	// Every entry jumps to the tracer, which then jumps to the real handler.
+	static void* const trace_labels[] = {
+#define __ENUMERATE(op, operands) &&trace,
+		__ENUMERATE_OP_CODES
+#undef __ENUMERATE
+	};
+	void* const* labels = vm->debug ? trace_labels : op_labels;
+
+#define LABEL(op) op_ ## op
+#define DISPATCH_DECODED() goto *labels[*ip]
+#else
+#define LABEL(op) case OP_ ## op
+#define DISPATCH_DECODED() goto decoded
+#endif
+// Handlers know the length of their instruction at compile time, which keeps
+// decoding it off the path to the next one.
+#define CASE(op) LABEL(op): length = op_length(OP_ ## op); goto body_ ## op; body_ ## op
+// Operands are read ahead, WIDE prefixes decode them before dispatching their
+// instruction themselves.
+#define DISPATCH() arg = ip[1]; DISPATCH_DECODED();
+#define NEXT() ip += length; DISPATCH();
+#define ARG_A (ip[1])
+#define ARG_B (ip[2])
+
+#define PUSH(v) (*sp++ = (v))
+#define POP() (*--sp)
+#define PEEK() (sp[-1])
+#define SAVE_SP() (vm->sp = sp)
+#define LOAD_SP() (sp = vm->sp, slots = vm->stack + f->stack_start)
+#define SAVE_IP() (f->ip = ip)
+#define LOAD_IP() (ip = f->ip)
+// Continue a caller after its call instruction, where it saved its ip. The
+// length of the returning instruction says nothing about that one.
+#define RESUME() LOAD_IP(); ip += op_length(*ip); DISPATCH();
+#define THROW(...) do { runtime_error(vm, __VA_ARGS__); goto error; } while (0)
+
+#if USE_COMPUTED_GOTO
+	DISPATCH();
+
+trace:
+	printf("%p%*s %s %u\n", (void*)&vm->frames[base], (int)vm->frame_count * 2, "", op_names[*ip], arg);
+	goto *op_labels[*ip];
+#else
+	arg = ip[1];
+decoded:
+	if (vm->debug) printf("%p%*s %s %u\n", (void*)&vm->frames[base], (int)vm->frame_count * 2, "", op_names[*ip], arg);
+
+	switch (*ip) {
+#endif
+
+	// Do nothing
+	CASE(NOP): {
+		NEXT();
+	}
+	// Prefix the operand of the next instruction with more significant bytes
+	CASE(WIDE): {
+		uint32_t high = 0;
+		for (; *ip == OP_WIDE; ip += 2)
+			high = high << 8 | ip[1];
+		arg = high << 8 | ip[1];
+		DISPATCH_DECODED();
+	}
+	// Push a number of null values on the stack
+	CASE(PUSH): {
+		for (uint32_t i = 0; i < arg; ++i) {
+			PUSH(VALUE_NULL);
+		}
+		NEXT();
+	}
+	// Push a 'false' value
+	CASE(PUSH_FALSE): {
+		PUSH(VALUE_FALSE);
+		NEXT();
 	}
-		BINARY_OP(ADD, +)
-		BINARY_OP(SUB, -)
-		BINARY_OP(MUL, *)
-		BINARY_OP(DIV, /)
-		// BINARY_OP(MOD, %)
-		// BINARY_OP(BAND, &)
-		// BINARY_OP(BOR, |)
-		// BINARY_OP(XOR, ^)
-		// BINARY_OP(LSH, <<)
-		// BINARY_OP(RSH, >>)
-		// BINARY_OP(POW, **)
+	// Push a 'true' value
+	CASE(PUSH_TRUE): {
+		PUSH(VALUE_TRUE);
+		NEXT();
+	}
+	// Push a constant (number, string, instance...) value
+	CASE(PUSH_CONST): {
+		PUSH(f->callee->compiled.constants.data[arg]);
+		NEXT();
+	}
+	// Load a value to the stack
+	CASE(LOAD): {
+		PUSH(slots[arg]);
+		NEXT();
+	}
+	// Store a value from the stack
+	CASE(STORE): {
+		slots[arg] = PEEK();
+		NEXT();
+	}
+	// Load an upvalue to the stack
+	CASE(LOAD_UP): {
+		PUSH(f->callee->compiled.captures.data[arg]);
+		NEXT();
+	}
+	// Store an upvalue from the stack
+	CASE(STORE_UP): {
+		value_t value = POP();
+		vm_gc_barrier(vm, &f->callee->header, value);
+		f->callee->compiled.captures.data[arg] = value;
+		NEXT();
+	}
+
+// Generic handlers rewrite themselves to their _NUM variant once they have
+// seen numbers. The variant only guards its operands and works in place, it
+// rewrites itself to the _DEOPT handler when the guard fails. That one is
+// generic but never quickens again, so a site seeing other values does not
+// keep rewriting itself.
+#define BINARY_OP(name, operator, result) CASE(name): { \
+	value_t a = POP(); \
+	value_t b = POP(); \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	*ip = OP_ ## name ## _NUM; \
+	PUSH(result(AS_NUMBER(a) operator AS_NUMBER(b))); \
+	NEXT(); \
+} \
+CASE(name ## _NUM): { \
+	value_t a = sp[-1]; \
+	value_t b = sp[-2]; \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+		*ip = OP_ ## name ## _DEOPT; \
+		DISPATCH(); \
+	} \
+	sp[-2] = result(AS_NUMBER(a) operator AS_NUMBER(b)); \
+	sp--; \
+	NEXT(); \
+} \
+CASE(name ## _DEOPT): { \
+	value_t a = POP(); \
+	value_t b = POP(); \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	PUSH(result(AS_NUMBER(a) operator AS_NUMBER(b))); \
+	NEXT(); \
+}
+	BINARY_OP(ADD, +, VALUE_NUMBER)
+	BINARY_OP(SUB, -, VALUE_NUMBER)
+	BINARY_OP(MUL, *, VALUE_NUMBER)
+	BINARY_OP(DIV, /, VALUE_NUMBER)
+	BINARY_OP(GT, >, VALUE_BOOL)
+	BINARY_OP(GTE, >=, VALUE_BOOL)
+	BINARY_OP(LT, <, VALUE_BOOL)
+	BINARY_OP(LTE, <=, VALUE_BOOL)
+	// BINARY_OP(MOD, %)
+	// BINARY_OP(BAND, &)
+	// BINARY_OP(BOR, |)
+	// BINARY_OP(XOR, ^)
+	// BINARY_OP(LSH, <<)
+	// BINARY_OP(RSH, >>)
+	// BINARY_OP(POW, **)
 #undef BINARY_OP
 
-		case OP_INC: {
-			value_t a = vm_pop(vm);
-			if (!IS_NUMBER(a))
-				return runtime_error(vm, "operand of INC is not a Number");
-			value_t res = VALUE_NUMBER(AS_NUMBER(a) + 1);
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_DEC: {
-			value_t a = vm_pop(vm);
-			if (!IS_NUMBER(a))
-				return runtime_error(vm, "operand of DEC is not a Number");
-			value_t res = VALUE_NUMBER(AS_NUMBER(a) - 1);
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_NEG: {
-			value_t a = vm_pop(vm);
-			if (!IS_NUMBER(a))
-				return runtime_error(vm, "operand of NEG is not a Number");
-			value_t res = VALUE_NUMBER(-AS_NUMBER(a));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_EQ: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			// FIXME: compare types first?
-			value_t res = VALUE_BOOL(value_equals(a, b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_NEQ: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			// FIXME: compare types first?
-			value_t res = VALUE_BOOL(!value_equals(a, b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_GT: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_NUMBER(a) || !IS_NUMBER(b))
-				return runtime_error(vm, "operand of GT is not a Number");
-			value_t res = VALUE_BOOL(AS_NUMBER(a) > AS_NUMBER(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_GTE: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_NUMBER(a) || !IS_NUMBER(b))
-				return runtime_error(vm, "operand of GTE is not a Number");
-			value_t res = VALUE_BOOL(AS_NUMBER(a) >= AS_NUMBER(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_LT: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_NUMBER(a) || !IS_NUMBER(b))
-				return runtime_error(vm, "operand of LT is not a Number");
-			value_t res = VALUE_BOOL(AS_NUMBER(a) < AS_NUMBER(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_LTE: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_NUMBER(a) || !IS_NUMBER(b))
-				return runtime_error(vm, "operand of LTE is not a Number");
-			value_t res = VALUE_BOOL(AS_NUMBER(a) <= AS_NUMBER(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_CMP: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_NUMBER(a) || !IS_NUMBER(b))
-				return runtime_error(vm, "operand of CMP is not a Number");
-			value_t res = VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_AND: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_BOOL(a) || !IS_BOOL(b))
-				return runtime_error(vm, "operand of AND is not a Bool");
-			value_t res = VALUE_BOOL(AS_BOOL(a) && AS_BOOL(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_OR: {
-			value_t a = vm_pop(vm);
-			value_t b = vm_pop(vm);
-			if (!IS_BOOL(a) || !IS_BOOL(b))
-				return runtime_error(vm, "operand of OR is not a Bool");
-			value_t res = VALUE_BOOL(AS_BOOL(a) || AS_BOOL(b));
-			vm_push(vm, res);
-			NEXT();
-		}
-		case OP_NOT: {
-			value_t a = vm_pop(vm);
-			if (!IS_BOOL(a))
-				return runtime_error(vm, "operand of NOT is not a Bool");
-			value_t res = VALUE_BOOL(!AS_BOOL(a));
-			vm_push(vm, res);
-			NEXT();
-		}
-		// case OP_BNOT: {
-		// 	value_t a = vm_pop(vm);
-		// 	if (!IS_NUMBER(a))
-		// 		return runtime_error(vm, "operand of BNOT is not a Number");
-		// 	value_t res = VALUE_NUMBER(~((uint64_t)AS_NUMBER(a)));
-		// 	vm_push(vm, res);
-		// 	NEXT();
-		// }
-
-		// Get a value from the global object
-		case OP_GETG: {
-			value_t key = vm_pop(vm);
-			value_t value = table_get(vm->global, key);
-			if (value == VALUE_NULL) return runtime_error(vm, "undefined variable '%s'", ((string_t*)AS_OBJECT(key))->data);
-			vm_push(vm, value);
+	CASE(INC): {
+		value_t a = POP();
+		if (!IS_NUMBER(a))
+			THROW("operand of INC is not a Number");
+		value_t res = VALUE_NUMBER(AS_NUMBER(a) + 1);
+		PUSH(res);
+		NEXT();
+	}
+	CASE(DEC): {
+		value_t a = POP();
+		if (!IS_NUMBER(a))
+			THROW("operand of DEC is not a Number");
+		value_t res = VALUE_NUMBER(AS_NUMBER(a) - 1);
+		PUSH(res);
+		NEXT();
+	}
+	CASE(NEG): {
+		value_t a = POP();
+		if (!IS_NUMBER(a))
+			THROW("operand of NEG is not a Number");
+		value_t res = VALUE_NUMBER(-AS_NUMBER(a));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(EQ): {
+		value_t a = POP();
+		value_t b = POP();
+		// FIXME: compare types first?
+		value_t res = VALUE_BOOL(value_equals(a, b));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(NEQ): {
+		value_t a = POP();
+		value_t b = POP();
+		// FIXME: compare types first?
+		value_t res = VALUE_BOOL(!value_equals(a, b));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(CMP): {
+		value_t a = POP();
+		value_t b = POP();
+		if (!IS_NUMBER(a) || !IS_NUMBER(b))
+			THROW("operand of CMP is not a Number");
+		value_t res = VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(AND): {
+		value_t a = POP();
+		value_t b = POP();
+		if (!IS_BOOL(a) || !IS_BOOL(b))
+			THROW("operand of AND is not a Bool");
+		value_t res = VALUE_BOOL(AS_BOOL(a) && AS_BOOL(b));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(OR): {
+		value_t a = POP();
+		value_t b = POP();
+		if (!IS_BOOL(a) || !IS_BOOL(b))
+			THROW("operand of OR is not a Bool");
+		value_t res = VALUE_BOOL(AS_BOOL(a) || AS_BOOL(b));
+		PUSH(res);
+		NEXT();
+	}
+	CASE(NOT): {
+		value_t a = POP();
+		if (!IS_BOOL(a))
+			THROW("operand of NOT is not a Bool");
+		value_t res = VALUE_BOOL(!AS_BOOL(a));
+		PUSH(res);
+		NEXT();
+	}
+	// CASE(BNOT): {
+	// 	value_t a = POP();
+	// 	if (!IS_NUMBER(a))
+	// 		THROW("operand of BNOT is not a Number");
+	// 	value_t res = VALUE_NUMBER(~((uint64_t)AS_NUMBER(a)));
+	// 	PUSH(res);
+	// 	NEXT();
+	// }
+
+	// Get a value from the global object
+	CASE(GETG): {
+		value_t key = POP();
+		value_t value = table_get(vm->global, key);
+		if (value == VALUE_NULL) THROW("undefined variable '%s'", ((string_t*)AS_OBJECT(key))->data);
+		PUSH(value);
+		NEXT();
+	}
+	// Get a global through its compile-time slot
+	CASE(GETG_SLOT): {
+		global_slot_t* slot = &((global_slot_t*)vm->global_slots.data)[arg];
+		if (slot->version != vm->global->version) {
+			slot->value = table_get(vm->global, slot->name);
+			slot->version = vm->global->version;
+		}
+		if (slot->value == VALUE_NULL) THROW("undefined variable '%s'", AS_STRING(slot->name)->data);
+		PUSH(slot->value);
+		NEXT();
+	}
+	// Set a global through its compile-time slot, writes go through the global
+	// table so by-name lookups see them.
+	CASE(SETG_SLOT): {
+		global_slot_t* slot = &((global_slot_t*)vm->global_slots.data)[arg];
+		// Growing the table may collect
+		SAVE_SP();
+		table_set(vm, vm->global, slot->name, PEEK());
+		slot->value = PEEK();
+		slot->version = vm->global->version;
+		NEXT();
+	}
+	// Get a property from a value
+	CASE(GETP): {
+		value_t this = POP();
+		value_t prop_name = POP();
+		assert(IS_STRING(prop_name));
+		class_t* class = get_class(vm, this);
+		assert(class);
+		inline_cache_t* cache = &((inline_cache_t*)f->callee->compiled.caches.data)[arg];
+		value_t prop_value = get_property(vm, f->callee, cache, class, prop_name);
+		if (prop_value == VALUE_NULL) THROW("undefined property '%s' on value of type '%s'", AS_STRING(prop_name)->data, class->name->data);
+		// Insert `this` value into stack for methods calls
+		if (IS_FUNCTION(prop_value) && (ip[op_length(OP_GETP)] == OP_CALL || ip[op_length(OP_GETP)] == OP_TAIL_CALL))
+			PUSH(this);
+		PUSH(prop_value);
+		NEXT();
+	}
+	// Register upvalues into a function's captures
+	CASE(CLOSE): {
+		value_t fn_v = POP();
+		function_t* fn = (function_t*)AS_OBJECT(fn_v);
+		for (uint32_t i = 0; i < arg; ++i) {
+			value_t upv = POP();
+			vm_gc_barrier(vm, &fn->header, upv);
+			if (!value_vector_push(&fn->compiled.captures, upv))
+				vm_out_of_memory(vm);
+		}
+		PUSH(fn_v);
+		NEXT();
+	}
+#define CALL_VALUE(value, argc) do { \
+	SAVE_SP(); \
+	if (is_native(value)) { \
+		if (call_native(vm, AS_FUNCTION(value), argc) < 0) goto error; \
+		LOAD_SP(); \
+		NEXT(); \
+	} \
+	SAVE_IP(); \
+	f = push_frame(vm, value, argc); \
+	if (!f) goto error; \
+	if (jit_ready(vm, f->callee)) { \
+		if (!jit_enter(vm, f)) goto error; \
+		f = &vm->frames[vm->frame_count - 1]; \
+		LOAD_SP(); \
+		NEXT(); \
+	} \
+	LOAD_SP(); \
+	LOAD_IP(); \
+	DISPATCH(); \
+} while (0)
+
+	// Call a function
+	CASE(CALL): {
+		value_t callee = POP();
+		CALL_VALUE(callee, arg);
+	}
+	// Call a function in place of the current one
+	CASE(TAIL_CALL): {
+		value_t callee = POP();
+		SAVE_SP();
+		if (is_native(callee)) {
+			int8_t n_returned = call_native(vm, AS_FUNCTION(callee), arg);
+			if (n_returned < 0) goto error;
+			if (n_returned == 0) vm_push(vm, VALUE_NULL);
+			f = pop_frame(vm, 1);
+			if (vm->frame_count == base) return true;
+			LOAD_SP();
+			RESUME();
+		}
+		f = replace_frame(vm, callee, arg);
+		if (!f) goto error;
+		if (jit_ready(vm, f->callee)) {
+			if (!jit_enter(vm, f)) goto error;
+			if (vm->frame_count == base) return true;
+			f = &vm->frames[vm->frame_count - 1];
+			LOAD_SP();
+			RESUME();
+		}
+		LOAD_SP();
+		LOAD_IP();
+		DISPATCH();
+	}
+	// Return from a function
+	CASE(RETURN): {
+		SAVE_SP();
+		f = pop_frame(vm, arg);
+		if (vm->frame_count == base) return true;
+		LOAD_SP();
+		RESUME();
+	}
+	// Jump
+	CASE(JUMP): {
+		ip += arg;
+		DISPATCH();
+	}
+	// Jump if value is false
+	CASE(JUMP_IF): {
+		value_t truth = POP();
+		if (!IS_BOOL(truth)) THROW("condition did not result in a boolean");
+		if (AS_BOOL(truth)) {
 			NEXT();
 		}
-		// Get a property from a value
-		case OP_GETP: {
-			value_t this = vm_pop(vm);
-			value_t prop_name = vm_pop(vm);
-			assert(IS_STRING(prop_name));
-			class_t* class = get_class(vm, this);
-			assert(class);
-			value_t prop_value = table_get(class->properties, prop_name);
-			if (prop_value == VALUE_NULL) return runtime_error(vm, "undefined property '%s' on value of type '%s'", (string_t*)AS_OBJECT(prop_name), class->name);
-			// Insert `this` value into stack for methods calls
-			if (IS_FUNCTION(prop_value) && f->ip[1].op == OP_CALL)
-				vm_push(vm, this);
-			vm_push(vm, prop_value);
+		ip += arg;
+		DISPATCH();
+	}
+
+	// Superinstructions, see src/compiler/superinstructions.c
+
+#define BINARY_OP_LOCALS(name, op) CASE(name ## _LL): { \
+	value_t a = slots[ARG_B]; \
+	value_t b = slots[ARG_A]; \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	PUSH(VALUE_NUMBER(AS_NUMBER(a) op AS_NUMBER(b))); \
+	NEXT(); \
+}
+	BINARY_OP_LOCALS(ADD, +)
+	BINARY_OP_LOCALS(SUB, -)
+	BINARY_OP_LOCALS(MUL, *)
+	BINARY_OP_LOCALS(DIV, /)
+#undef BINARY_OP_LOCALS
+
+#define BINARY_OP_CONSTANT(name, op, result) CASE(name ## _LK): { \
+	value_t a = slots[ARG_B]; \
+	value_t b = f->callee->compiled.constants.data[ARG_A]; \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	PUSH(result(AS_NUMBER(a) op AS_NUMBER(b))); \
+	NEXT(); \
+}
+	BINARY_OP_CONSTANT(ADD, +, VALUE_NUMBER)
+	BINARY_OP_CONSTANT(SUB, -, VALUE_NUMBER)
+	BINARY_OP_CONSTANT(MUL, *, VALUE_NUMBER)
+	BINARY_OP_CONSTANT(DIV, /, VALUE_NUMBER)
+	BINARY_OP_CONSTANT(LT, <, VALUE_BOOL)
+	BINARY_OP_CONSTANT(LTE, <=, VALUE_BOOL)
+	BINARY_OP_CONSTANT(GT, >, VALUE_BOOL)
+	BINARY_OP_CONSTANT(GTE, >=, VALUE_BOOL)
+#undef BINARY_OP_CONSTANT
+
+#define COMPARE_AND_JUMP(name, op) CASE(name ## _JUMP_IF): { \
+	value_t a = POP(); \
+	value_t b = POP(); \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	if (AS_NUMBER(a) op AS_NUMBER(b)) { \
+		NEXT(); \
+	} \
+	ip += arg; \
+	DISPATCH(); \
+}
+	COMPARE_AND_JUMP(LT, <)
+	COMPARE_AND_JUMP(LTE, <=)
+	COMPARE_AND_JUMP(GT, >)
+	COMPARE_AND_JUMP(GTE, >=)
+#undef COMPARE_AND_JUMP
+
+// The jump offset is the first operand, the local and the constant or other
+// local come after it
+#define COMPARE_FUSED_AND_JUMP(name, operands, rhs, op) CASE(name ## _ ## operands ## _JUMP_IF): { \
+	value_t a = slots[ip[3]]; \
+	value_t b = rhs; \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) \
+		THROW("operand of " #name " is not a Number"); \
+	if (AS_NUMBER(a) op AS_NUMBER(b)) { \
+		NEXT(); \
+	} \
+	ip += arg; \
+	DISPATCH(); \
+}
+	COMPARE_FUSED_AND_JUMP(LT, LL, slots[ip[2]], <)
+	COMPARE_FUSED_AND_JUMP(LTE, LL, slots[ip[2]], <=)
+	COMPARE_FUSED_AND_JUMP(GT, LL, slots[ip[2]], >)
+	COMPARE_FUSED_AND_JUMP(GTE, LL, slots[ip[2]], >=)
+	COMPARE_FUSED_AND_JUMP(LT, LK, f->callee->compiled.constants.data[ip[2]], <)
+	COMPARE_FUSED_AND_JUMP(LTE, LK, f->callee->compiled.constants.data[ip[2]], <=)
+	COMPARE_FUSED_AND_JUMP(GT, LK, f->callee->compiled.constants.data[ip[2]], >)
+	COMPARE_FUSED_AND_JUMP(GTE, LK, f->callee->compiled.constants.data[ip[2]], >=)
+#undef COMPARE_FUSED_AND_JUMP
+
+	CASE(EQ_JUMP_IF): {
+		value_t a = POP();
+		value_t b = POP();
+		if (value_equals(a, b)) {
 			NEXT();
 		}
-		// Register upvalues into a function's captures
-		case OP_CLOSE: {
-			value_t fn_v = vm_pop(vm);
-			function_t* fn = (function_t*)AS_OBJECT(fn_v);
-			for (int i = 0; i < f->ip->arg; ++i) {
-				value_t upv = vm_pop(vm);
-				buffer_push(&fn->compiled.captures, &upv);
-			}
-			vm_push(vm, fn_v);
+		ip += arg;
+		DISPATCH();
+	}
+	CASE(NEQ_JUMP_IF): {
+		value_t a = POP();
+		value_t b = POP();
+		if (!value_equals(a, b)) {
 			NEXT();
 		}
-		// Call a function
-		case OP_CALL: {
-			value_t callee = vm_pop(vm);
-			f = push_frame(vm, &frames, callee, f->ip->arg);
-			goto start;
-		}
-		// Return from a function
-		case OP_RETURN: {
-			uint8_t n_return = f->ip->arg;
-			f = pop_frame(vm, &frames, n_return);
-			if (f) f->ip++;
-			goto start;
-		}
-		// Jump
-		case OP_JUMP: {
-			f->ip += f->ip->arg;
-			goto start;
-		}
-		// Jump if value is false
-		case OP_JUMP_IF: {
-			value_t truth = vm_pop(vm);
-			if (!IS_BOOL(truth)) return runtime_error(vm, "condition did not result in a boolean");
-			f->ip += AS_BOOL(truth) ? 1 : f->ip->arg;
-			goto start;
-		}
+		ip += arg;
+		DISPATCH();
+	}
+	// Get a property and call it, as a method if it is a function
+	CASE(INVOKE): {
+		value_t this = POP();
+		value_t prop_name = POP();
+		assert(IS_STRING(prop_name));
+		class_t* class = get_class(vm, this);
+		assert(class);
+		inline_cache_t* cache = &((inline_cache_t*)f->callee->compiled.caches.data)[ARG_A];
+		value_t prop_value = get_property(vm, f->callee, cache, class, prop_name);
+		if (prop_value == VALUE_NULL) THROW("undefined property '%s' on value of type '%s'", AS_STRING(prop_name)->data, class->name->data);
+		if (IS_FUNCTION(prop_value))
+			PUSH(this);
+		CALL_VALUE(prop_value, ARG_B);
+	}
+#undef CALL_VALUE
 
-		default: {
-			printf("Unimplemented OP code (%d)\n", f->ip->op);
-			break;
-		}
+	// Not implemented yet
+	CASE(MOD):
+	CASE(POW):
+	CASE(BAND):
+	CASE(BOR):
+	CASE(BNOT):
+	CASE(XOR):
+	CASE(LSH):
+	CASE(RSH):
+	CASE(MAKE_ARRAY):
+	CASE(MAKE_TABLE):
+	{
+		THROW("unimplemented op code '%s'", op_names[*ip]);
+	}
 
-		}
+#if !USE_COMPUTED_GOTO
 	}
+#endif
 
+#undef THROW
+#undef RESUME
+#undef LOAD_IP
+#undef SAVE_IP
+#undef LOAD_SP
+#undef SAVE_SP
+#undef PEEK
+#undef POP
+#undef PUSH
+#undef ARG_B
+#undef ARG_A
 #undef NEXT
+#undef DISPATCH
+#undef DISPATCH_DECODED
+#undef CASE
+#undef LABEL
 
-	assert(f == NULL);
-	buffer_free(&frames);
+error:
+	// Drop every frame of this invocation, as if it returned nothing
+	vm->sp = vm->stack + vm->frames[base].stack_start;
+	vm->frame_count = base;
+	return false;
 }
@@ -0,0 +1,243 @@
+// Executor of the register backend, see include/vm/reg_op_codes.h. The frame
+// of a function spans `max_stack` registers from its `stack_start`, and
+// `vm->sp` is kept right above them so natives and nested calls start there.
+
+static const char* reg_op_names[] = {
+#define __ENUMERATE(op) #op,
+	__ENUMERATE_REG_OP_CODES
+#undef __ENUMERATE
+};
+
+// Registers past the arguments may hold anything, clear them
+static value_t* enter_registers(vm_t* vm, frame_t* f, uint8_t argc)
+{
+	value_t* registers = vm->stack + f->stack_start;
+	for (size_t i = argc; i < f->callee->compiled.max_stack; ++i)
+		registers[i] = VALUE_NULL;
+	vm->sp = registers + f->callee->compiled.max_stack;
+	return registers;
+}
+
+static bool interpret_registers(vm_t* vm, size_t base)
+{
+	frame_t* f = &vm->frames[base];
+	value_t* R = enter_registers(vm, f, vm->sp - vm->stack - f->stack_start);
+	value_t* K = f->callee->compiled.constants.data;
+
+#if USE_COMPUTED_GOTO
+	static void* const op_labels[] = {
+#define __ENUMERATE(op) &&op_ ## op,
+		__ENUMERATE_REG_OP_CODES
+#undef __ENUMERATE
+	};
+	static void* const trace_labels[] = {
+#define __ENUMERATE(op) &&trace,
+		__ENUMERATE_REG_OP_CODES
+#undef __ENUMERATE
+	};
+	void* const* labels = vm->debug ? trace_labels : op_labels;
+
+#define CASE(op) op_ ## op
+#define DISPATCH() goto *labels[f->rip->op]
+#else
+#define CASE(op) case ROP_ ## op
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() f->rip++; DISPATCH();
+
+// The stack may have been reallocated by anything pushing a frame
+#define LOAD_FRAME() (R = vm->stack + f->stack_start, K = f->callee->compiled.constants.data)
+#define THROW(...) do { runtime_error(vm, __VA_ARGS__); goto error; } while (0)
+#define A (f->rip->a)
+#define B (f->rip->b)
+#define C (f->rip->c)
+#define BX (f->rip->bx)
+
+#if USE_COMPUTED_GOTO
+	DISPATCH();
+
+trace:
+	printf("%p%*s %s %u %u %u\n", (void*)&vm->frames[base], (int)vm->frame_count * 2, "", reg_op_names[f->rip->op], A, B, C);
+	goto *op_labels[f->rip->op];
+#else
+dispatch:
+	if (vm->debug) printf("%p%*s %s %u %u %u\n", (void*)&vm->frames[base], (int)vm->frame_count * 2, "", reg_op_names[f->rip->op], A, B, C);
+
+	switch (f->rip->op) {
+#endif
+
+	// Do nothing
+	CASE(NOP): {
+		NEXT();
+	}
+	// Copy a register
+	CASE(MOVE): {
+		R[A] = R[B];
+		NEXT();
+	}
+	// Load a constant (number, string, instance...) value
+	CASE(LOADK): {
+		R[A] = K[BX];
+		NEXT();
+	}
+	// Load a 'null' value
+	CASE(LOADNULL): {
+		R[A] = VALUE_NULL;
+		NEXT();
+	}
+	// Load a 'true' or 'false' value
+	CASE(LOADBOOL): {
+		R[A] = B ? VALUE_TRUE : VALUE_FALSE;
+		NEXT();
+	}
+	// Load an upvalue
+	CASE(GETUP): {
+		R[A] = f->callee->compiled.captures.data[B];
+		NEXT();
+	}
+	// Get a global through its compile-time slot
+	CASE(GETG): {
+		global_slot_t* slot = &((global_slot_t*)vm->global_slots.data)[BX];
+		if (slot->version != vm->global->version) {
+			slot->value = table_get(vm->global, slot->name);
+			slot->version = vm->global->version;
+		}
+		if (slot->value == VALUE_NULL) THROW("undefined variable '%s'", AS_STRING(slot->name)->data);
+		R[A] = slot->value;
+		NEXT();
+	}
+	// Get a property from a value, its name is in the following instruction
+	CASE(GETP): {
+		value_t this = R[B];
+		value_t prop_name = K[f->rip[1].bx];
+		assert(IS_STRING(prop_name));
+		class_t* class = get_class(vm, this);
+		assert(class);
+		inline_cache_t* cache = &((inline_cache_t*)f->callee->compiled.caches.data)[C];
+		value_t prop_value = get_property(vm, f->callee, cache, class, prop_name);
+		if (prop_value == VALUE_NULL) THROW("undefined property '%s' on value of type '%s'", AS_STRING(prop_name)->data, class->name->data);
+		R[A] = prop_value;
+		f->rip += 2;
+		DISPATCH();
+	}
+
+#define BINARY_OP(name, op, type, result, type_name) CASE(name): { \
+	value_t a = R[B]; \
+	value_t b = R[C]; \
+	if (!IS_ ## type(a) || !IS_ ## type(b)) \
+		THROW("operand of " #name " is not a " type_name); \
+	R[A] = result(AS_ ## type(a) op AS_ ## type(b)); \
+	NEXT(); \
+}
+	BINARY_OP(ADD, +, NUMBER, VALUE_NUMBER, "Number")
+	BINARY_OP(SUB, -, NUMBER, VALUE_NUMBER, "Number")
+	BINARY_OP(MUL, *, NUMBER, VALUE_NUMBER, "Number")
+	BINARY_OP(DIV, /, NUMBER, VALUE_NUMBER, "Number")
+	BINARY_OP(CMP, -, NUMBER, VALUE_NUMBER, "Number")
+	BINARY_OP(GT, >, NUMBER, VALUE_BOOL, "Number")
+	BINARY_OP(GTE, >=, NUMBER, VALUE_BOOL, "Number")
+	BINARY_OP(LT, <, NUMBER, VALUE_BOOL, "Number")
+	BINARY_OP(LTE, <=, NUMBER, VALUE_BOOL, "Number")
+	BINARY_OP(AND, &&, BOOL, VALUE_BOOL, "Bool")
+	BINARY_OP(OR, ||, BOOL, VALUE_BOOL, "Bool")
+#undef BINARY_OP
+
+	CASE(EQ): {
+		R[A] = VALUE_BOOL(value_equals(R[B], R[C]));
+		NEXT();
+	}
+	CASE(NEQ): {
+		R[A] = VALUE_BOOL(!value_equals(R[B], R[C]));
+		NEXT();
+	}
+	// Register upvalues into a function's captures
+	CASE(CLOSE): {
+		function_t* fn = AS_FUNCTION(R[A]);
+		for (uint8_t i = 0; i < C; ++i) {
+			vm_gc_barrier(vm, &fn->header, R[B + i]);
+			if (!value_vector_push(&fn->compiled.captures, R[B + i]))
+				vm_out_of_memory(vm);
+		}
+		NEXT();
+	}
+	// Call a function
+	CASE(CALL): {
+		value_t callee = R[A];
+		vm->sp = R + A + 1 + B + C;
+		if (is_native(callee)) {
+			int8_t n_returned = call_native(vm, AS_FUNCTION(callee), B);
+			if (n_returned < 0) goto error;
+			LOAD_FRAME();
+			R[A] = n_returned ? vm->sp[-1] : VALUE_NULL;
+			vm->sp = R + f->callee->compiled.max_stack;
+			NEXT();
+		}
+		uint8_t argc = B;
+		f = push_frame(vm, callee, argc);
+		if (!f) goto error;
+		R = enter_registers(vm, f, argc);
+		K = f->callee->compiled.constants.data;
+		DISPATCH();
+	}
+	// Return from a function, into the register its caller called it from
+	CASE(RETURN): {
+		value_t ret = B ? R[A] : VALUE_NULL;
+		if (vm->debug) printf("--- STACK_START WAS %zu, RETURNED %d\n", f->stack_start, B);
+		vm->frame_count--;
+		if (vm->frame_count == base) {
+			vm->sp = vm->stack + f->stack_start;
+			if (B) vm_push(vm, ret);
+			return true;
+		}
+		f--;
+		LOAD_FRAME();
+		R[A] = ret;
+		vm->sp = R + f->callee->compiled.max_stack;
+		NEXT();
+	}
+	// Jump
+	CASE(JUMP): {
+		f->rip += BX;
+		DISPATCH();
+	}
+	// Jump if value is false
+	CASE(JUMP_IF): {
+		value_t truth = R[A];
+		if (!IS_BOOL(truth)) THROW("condition did not result in a boolean");
+		f->rip += AS_BOOL(truth) ? 1 : BX;
+		DISPATCH();
+	}
+
+	// Not implemented yet
+	CASE(EXTRA):
+	CASE(MOD):
+	CASE(POW):
+	CASE(BAND):
+	CASE(BOR):
+	CASE(XOR):
+	CASE(LSH):
+	CASE(RSH):
+	{
+		THROW("unimplemented op code '%s'", reg_op_names[f->rip->op]);
+	}
+
+#if !USE_COMPUTED_GOTO
+	}
+#endif
+
+#undef BX
+#undef C
+#undef B
+#undef A
+#undef THROW
+#undef LOAD_FRAME
+#undef NEXT
+#undef DISPATCH
+#undef CASE
+
+error:
+	// Drop every frame of this invocation, as if it returned nothing
+	vm->sp = vm->stack + vm->frames[base].stack_start;
+	vm->frame_count = base;
+	return false;
+}
@@ -0,0 +1,645 @@
+#include <assert.h>
+#include <string.h>
+#include "jit/jit.h"
+#include "vm.h"
+#include "vm/interpreter.h"
+
+#if USE_JIT
+
+#include <sys/mman.h>
+
+// Machine code is generated for the System V x86-64 ABI. Translated functions
+// have the signature `bool (vm_t*, frame_t*)` and keep their state in
+// callee-saved registers:
+//   rbx  vm
+//   rbp  NAN_MASK, to check for numbers
+//   r12  stack pointer, written back to `vm->sp` around runtime calls
+//   r13  frame slots
+//   r14  function constants
+//   r15  frame
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { XMM0, XMM1 };
+
+// Condition codes
+enum { CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7 };
+
+typedef struct assembler {
+	uint8_t* code;
+	size_t size, capacity;
+	// Machine code offset of each instruction, followed by the error and
+	// return exits
+	size_t* labels;
+	// Jumps to a label, patched once every label is known
+	buffer_t fixups;
+	// Out of memory, the function is left to the interpreter
+	bool failed;
+} assembler_t;
+
+typedef struct fixup {
+	size_t at;
+	size_t label;
+} fixup_t;
+
+static void emit8(assembler_t* as, uint8_t byte)
+{
+	if (as->failed)
+		return;
+	if (as->size == as->capacity) {
+		size_t capacity = as->capacity ? as->capacity * 2 : 256;
+		uint8_t* code = REALLOC(as->code, capacity);
+		if (!code) {
+			as->failed = true;
+			return;
+		}
+		as->code = code;
+		as->capacity = capacity;
+	}
+	as->code[as->size++] = byte;
+}
+
+static void emit32(assembler_t* as, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		emit8(as, value >> (i * 8));
+}
+
+static void emit64(assembler_t* as, uint64_t value)
+{
+	for (int i = 0; i < 8; ++i)
+		emit8(as, value >> (i * 8));
+}
+
+static inline void rex_w(assembler_t* as, int reg, int rm) {
+	emit8(as, 0x48 | (reg >> 3) << 2 | (rm >> 3));
+}
+
+static inline void modrm_reg(assembler_t* as, int reg, int rm) {
+	emit8(as, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// [base + disp32], rsp and r12 need a SIB byte
+static inline void modrm_mem(assembler_t* as, int reg, int base, int32_t disp)
+{
+	emit8(as, 0x80 | (reg & 7) << 3 | (base & 7));
+	if ((base & 7) == RSP)
+		emit8(as, 0x24);
+	emit32(as, disp);
+}
+
+// mov dst, [base + disp]
+static void mov_load(assembler_t* as, int dst, int base, int32_t disp)
+{
+	rex_w(as, dst, base);
+	emit8(as, 0x8B);
+	modrm_mem(as, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void mov_store(assembler_t* as, int base, int32_t disp, int src)
+{
+	rex_w(as, src, base);
+	emit8(as, 0x89);
+	modrm_mem(as, src, base, disp);
+}
+
+// mov dst, imm64
+static void mov_imm(assembler_t* as, int dst, uint64_t imm)
+{
+	emit8(as, 0x48 | (dst >> 3));
+	emit8(as, 0xB8 + (dst & 7));
+	emit64(as, imm);
+}
+
+// <op> dst, src for add (0x01), or (0x09), and (0x21), cmp (0x39) and mov (0x89)
+static void alu(assembler_t* as, uint8_t op, int dst, int src)
+{
+	rex_w(as, src, dst);
+	emit8(as, op);
+	modrm_reg(as, src, dst);
+}
+
+// add dst, imm32 (ext 0) or sub dst, imm32 (ext 5)
+static void alu_imm(assembler_t* as, int ext, int dst, int32_t imm)
+{
+	rex_w(as, 0, dst);
+	emit8(as, 0x81);
+	modrm_reg(as, ext, dst);
+	emit32(as, imm);
+}
+
+#define ADD_IMM(as, dst, imm) alu_imm(as, 0, dst, imm)
+#define SUB_IMM(as, dst, imm) alu_imm(as, 5, dst, imm)
+
+// movsd xmm, [base + disp]
+static void movsd_load(assembler_t* as, int xmm, int base, int32_t disp)
+{
+	emit8(as, 0xF2);
+	if (base >= R8) emit8(as, 0x41);
+	emit8(as, 0x0F);
+	emit8(as, 0x10);
+	modrm_mem(as, xmm, base, disp);
+}
+
+// movsd [base + disp], xmm
+static void movsd_store(assembler_t* as, int base, int32_t disp, int xmm)
+{
+	emit8(as, 0xF2);
+	if (base >= R8) emit8(as, 0x41);
+	emit8(as, 0x0F);
+	emit8(as, 0x11);
+	modrm_mem(as, xmm, base, disp);
+}
+
+// addsd (0x58), mulsd (0x59), subsd (0x5C), divsd (0x5E) and ucomisd (0x2E)
+static void sse(assembler_t* as, uint8_t op, int dst, int src)
+{
+	emit8(as, op == 0x2E ? 0x66 : 0xF2);
+	emit8(as, 0x0F);
+	emit8(as, op);
+	modrm_reg(as, dst, src);
+}
+
+static void jump_to(assembler_t* as, int cc, size_t label)
+{
+	if (cc < 0) {
+		emit8(as, 0xE9);
+	} else {
+		emit8(as, 0x0F);
+		emit8(as, 0x80 + cc);
+	}
+	fixup_t fixup = { as->size, label };
+	if (!buffer_push(&as->fixups, &fixup))
+		as->failed = true;
+	emit32(as, 0);
+}
+
+// Jump forward to a spot bound later with `bind`
+static size_t jump_forward(assembler_t* as, int cc)
+{
+	if (cc < 0) {
+		emit8(as, 0xE9);
+	} else {
+		emit8(as, 0x0F);
+		emit8(as, 0x80 + cc);
+	}
+	emit32(as, 0);
+	return as->size;
+}
+
+static void bind(assembler_t* as, size_t jump)
+{
+	if (as->failed)
+		return;
+	int32_t offset = as->size - jump;
+	memcpy(as->code + jump - 4, &offset, 4);
+}
+
+// Templates -------------------------------------------------------------------
+
+#define SLOT(n) ((int32_t)(n) * (int32_t)sizeof(value_t))
+
+static void reload_slots(assembler_t* as)
+{
+	mov_load(as, R13, RBX, offsetof(vm_t, stack));
+	mov_load(as, RCX, R15, offsetof(frame_t, stack_start));
+	rex_w(as, 0, RCX);
+	emit8(as, 0xC1);
+	modrm_reg(as, 4, RCX);
+	emit8(as, 3);
+	alu(as, 0x01, R13, RCX);
+}
+
+// Call `helper(vm, ...)` once the stack pointer is written back, the other
+// arguments must already be in rsi and rdx
+static void call_helper(assembler_t* as, void* helper)
+{
+	mov_store(as, RBX, offsetof(vm_t, sp), R12);
+	alu(as, 0x89, RDI, RBX);
+	mov_imm(as, RAX, (uint64_t)helper);
+	emit8(as, 0xFF);
+	modrm_reg(as, 2, RAX);
+}
+
+// Bail out if the helper returned false, then reload what it may have moved
+static void check_helper(assembler_t* as, size_t error_label)
+{
+	emit8(as, 0x84);
+	emit8(as, 0xC0);
+	jump_to(as, CC_E, error_label);
+	mov_load(as, R12, RBX, offsetof(vm_t, sp));
+	reload_slots(as);
+}
+
+// Run the instruction starting at `ip` through the runtime, which may move the
+// stack
+static void call_runtime(assembler_t* as, uint8_t* ip, size_t error_label)
+{
+	alu(as, 0x89, RSI, R15);
+	mov_imm(as, RDX, (uint64_t)ip);
+	call_helper(as, (void*)&jit_execute);
+	check_helper(as, error_label);
+}
+
+// Jump to `slow` unless `reg` holds a number
+static void guard_number(assembler_t* as, int reg, buffer_t* slow)
+{
+	alu(as, 0x89, RDX, reg);
+	alu(as, 0x21, RDX, RBP);
+	alu(as, 0x39, RDX, RBP);
+	size_t jump = jump_forward(as, CC_E);
+	if (!buffer_push(slow, &jump))
+		as->failed = true;
+}
+
+static void push_rax(assembler_t* as)
+{
+	mov_store(as, R12, 0, RAX);
+	ADD_IMM(as, R12, sizeof(value_t));
+}
+
+// Stands for the failing condition of any conditional jump at runtime
+static uint8_t not_a_boolean[] = { OP_JUMP_IF, 0 };
+
+// Pop a boolean and jump to `label` if it is false
+static void jump_if_false(assembler_t* as, size_t label, size_t error_label)
+{
+	SUB_IMM(as, R12, sizeof(value_t));
+	mov_load(as, RAX, R12, 0);
+	mov_imm(as, RCX, VALUE_TRUE);
+	alu(as, 0x39, RAX, RCX);
+	size_t is_true = jump_forward(as, CC_E);
+	mov_imm(as, RCX, VALUE_FALSE);
+	alu(as, 0x39, RAX, RCX);
+	jump_to(as, CC_E, label);
+	// Push the condition back for the runtime to report it
+	ADD_IMM(as, R12, sizeof(value_t));
+	call_runtime(as, not_a_boolean, error_label);
+	jump_to(as, -1, error_label);
+	bind(as, is_true);
+}
+
+typedef enum operands {
+	OPERANDS_STACK,
+	OPERANDS_LOCALS,
+	OPERANDS_CONSTANT,
+} operands_t;
+
+static operands_t operands_of(op_code_t op)
+{
+	switch (op) {
+	case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL:
+	case OP_LT_LL_JUMP_IF: case OP_LTE_LL_JUMP_IF: case OP_GT_LL_JUMP_IF: case OP_GTE_LL_JUMP_IF:
+		return OPERANDS_LOCALS;
+	case OP_ADD_LK: case OP_SUB_LK: case OP_MUL_LK: case OP_DIV_LK:
+	case OP_LT_LK: case OP_LTE_LK: case OP_GT_LK: case OP_GTE_LK:
+	case OP_LT_LK_JUMP_IF: case OP_LTE_LK_JUMP_IF: case OP_GT_LK_JUMP_IF: case OP_GTE_LK_JUMP_IF:
+		return OPERANDS_CONSTANT;
+	default:
+		return OPERANDS_STACK;
+	}
+}
+
+// Load the operands of a number operator in xmm0 (lhs) and xmm1 (rhs), popping
+// them off the stack if they are there. Jumps to `slow` with the stack
+// untouched if they are not numbers.
+static void load_numbers(assembler_t* as, op_t* ip, buffer_t* slow)
+{
+	int a_base = R12, b_base = R12;
+	int32_t a_disp = -SLOT(1), b_disp = -SLOT(2);
+	switch (operands_of(ip->op)) {
+	case OPERANDS_LOCALS:
+		a_base = R13, a_disp = SLOT(OP_ARG_B(op_byte_args(ip)));
+		b_base = R13, b_disp = SLOT(OP_ARG_A(op_byte_args(ip)));
+		break;
+	case OPERANDS_CONSTANT:
+		a_base = R13, a_disp = SLOT(OP_ARG_B(op_byte_args(ip)));
+		b_base = R14, b_disp = SLOT(OP_ARG_A(op_byte_args(ip)));
+		break;
+	case OPERANDS_STACK:
+		break;
+	}
+
+	mov_load(as, RAX, a_base, a_disp);
+	guard_number(as, RAX, slow);
+	mov_load(as, RAX, b_base, b_disp);
+	guard_number(as, RAX, slow);
+	movsd_load(as, XMM0, a_base, a_disp);
+	movsd_load(as, XMM1, b_base, b_disp);
+	if (operands_of(ip->op) == OPERANDS_STACK)
+		SUB_IMM(as, R12, 2 * sizeof(value_t));
+}
+
+static void bind_all(assembler_t* as, buffer_t* jumps)
+{
+	buffer_foreach(*jumps, size_t, jump)
+		bind(as, *jump);
+	jumps->size = 0;
+}
+
+// xmm0 = xmm0 <op> xmm1, pushed
+static void arithmetic(assembler_t* as, op_t* ip, uint8_t* pc, uint8_t sse_op, buffer_t* slow, size_t error_label)
+{
+	load_numbers(as, ip, slow);
+	sse(as, sse_op, XMM0, XMM1);
+	movsd_store(as, R12, 0, XMM0);
+	ADD_IMM(as, R12, sizeof(value_t));
+	size_t done = jump_forward(as, -1);
+	bind_all(as, slow);
+	call_runtime(as, pc, error_label);
+	bind(as, done);
+}
+
+// Compare xmm0 (lhs) and xmm1 (rhs) so that the condition code `*cc` is set
+// when the comparison holds, NaNs compare false
+static void compare(assembler_t* as, op_code_t op, int* cc)
+{
+	switch (op) {
+	case OP_LT: sse(as, 0x2E, XMM1, XMM0); *cc = CC_A; break;
+	case OP_LTE: sse(as, 0x2E, XMM1, XMM0); *cc = CC_AE; break;
+	case OP_GT: sse(as, 0x2E, XMM0, XMM1); *cc = CC_A; break;
+	case OP_GTE: sse(as, 0x2E, XMM0, XMM1); *cc = CC_AE; break;
+	default: assert(false);
+	}
+}
+
+static op_code_t comparison_of(op_code_t op)
+{
+	switch (op) {
+	case OP_LT: case OP_LT_NUM: case OP_LT_DEOPT: case OP_LT_LK: case OP_LT_JUMP_IF:
+	case OP_LT_LL_JUMP_IF: case OP_LT_LK_JUMP_IF: return OP_LT;
+	case OP_LTE: case OP_LTE_NUM: case OP_LTE_DEOPT: case OP_LTE_LK: case OP_LTE_JUMP_IF:
+	case OP_LTE_LL_JUMP_IF: case OP_LTE_LK_JUMP_IF: return OP_LTE;
+	case OP_GT: case OP_GT_NUM: case OP_GT_DEOPT: case OP_GT_LK: case OP_GT_JUMP_IF:
+	case OP_GT_LL_JUMP_IF: case OP_GT_LK_JUMP_IF: return OP_GT;
+	case OP_GTE: case OP_GTE_NUM: case OP_GTE_DEOPT: case OP_GTE_LK: case OP_GTE_JUMP_IF:
+	case OP_GTE_LL_JUMP_IF: case OP_GTE_LK_JUMP_IF: return OP_GTE;
+	default: return OP_NOP;
+	}
+}
+
+// Push the result of a comparison as a boolean
+static void comparison(assembler_t* as, op_t* ip, uint8_t* pc, buffer_t* slow, size_t error_label)
+{
+	int cc;
+	load_numbers(as, ip, slow);
+	compare(as, comparison_of(ip->op), &cc);
+	// setcc al; movzx eax, al
+	emit8(as, 0x0F);
+	emit8(as, 0x90 + cc);
+	emit8(as, 0xC0);
+	emit8(as, 0x0F);
+	emit8(as, 0xB6);
+	emit8(as, 0xC0);
+	mov_imm(as, RCX, VALUE_FALSE);
+	alu(as, 0x09, RAX, RCX);
+	push_rax(as);
+	size_t done = jump_forward(as, -1);
+	bind_all(as, slow);
+	call_runtime(as, pc, error_label);
+	bind(as, done);
+}
+
+// Branch on a comparison, the runtime pushes the result of the comparison on
+// the slow path
+static void compare_and_jump(assembler_t* as, op_t* ip, uint8_t* pc, size_t label, buffer_t* slow, size_t error_label)
+{
+	int cc;
+	load_numbers(as, ip, slow);
+	compare(as, comparison_of(ip->op), &cc);
+	// The condition code of the opposite comparison, NaNs included
+	jump_to(as, cc == CC_A ? CC_BE : CC_B, label);
+	size_t done = jump_forward(as, -1);
+	bind_all(as, slow);
+	call_runtime(as, pc, error_label);
+	jump_if_false(as, label, error_label);
+	bind(as, done);
+}
+
+static bool translate(assembler_t* as, function_t* fn)
+{
+	uint8_t* code = fn->compiled.code.data;
+	size_t size = fn->compiled.code.size;
+	// Labels are indexed by byte offset, jumps only land on instruction starts
+	size_t error_label = size + 1, return_label = size + 2, exit_label = size + 3;
+	buffer_t slow = buffer_new(sizeof(size_t));
+
+	// push rbx, rbp, r12, r13, r14, r15 then realign the stack
+	emit8(as, 0x53);
+	emit8(as, 0x55);
+	for (int reg = R12; reg <= R15; ++reg) {
+		emit8(as, 0x41);
+		emit8(as, 0x50 + (reg & 7));
+	}
+	SUB_IMM(as, RSP, 8);
+
+	alu(as, 0x89, RBX, RDI);
+	alu(as, 0x89, R15, RSI);
+	mov_imm(as, RBP, NAN_MASK);
+	mov_load(as, R12, RBX, offsetof(vm_t, sp));
+	reload_slots(as);
+	mov_load(as, RAX, R15, offsetof(frame_t, callee));
+	mov_load(as, R14, RAX, offsetof(function_t, compiled.constants.data));
+
+	for (size_t i = 0; i < size;) {
+		op_t op, *ip = &op;
+		uint8_t* pc = code + i;
+		// Offset of the op code, that jumps are relative to
+		size_t at = (uint8_t*)op_decode(pc, &op) - code;
+		as->labels[i] = as->size;
+		i = at + op_length(op.op);
+
+		switch (ip->op) {
+		case OP_NOP:
+			break;
+		case OP_PUSH_FALSE:
+		case OP_PUSH_TRUE:
+			mov_imm(as, RAX, ip->op == OP_PUSH_TRUE ? VALUE_TRUE : VALUE_FALSE);
+			push_rax(as);
+			break;
+		case OP_PUSH_CONST:
+			mov_load(as, RAX, R14, SLOT(ip->arg));
+			push_rax(as);
+			break;
+		case OP_LOAD:
+			mov_load(as, RAX, R13, SLOT(ip->arg));
+			push_rax(as);
+			break;
+		case OP_LOAD_UP:
+			mov_load(as, RAX, R15, offsetof(frame_t, callee));
+			mov_load(as, RAX, RAX, offsetof(function_t, compiled.captures.data));
+			mov_load(as, RAX, RAX, SLOT(ip->arg));
+			push_rax(as);
+			break;
+		case OP_STORE:
+			mov_load(as, RAX, R12, -SLOT(1));
+			mov_store(as, R13, SLOT(ip->arg), RAX);
+			break;
+		case OP_JUMP:
+			jump_to(as, -1, at + ip->arg);
+			break;
+		case OP_JUMP_IF:
+			jump_if_false(as, at + ip->arg, error_label);
+			break;
+		case OP_ADD: case OP_ADD_NUM: case OP_ADD_DEOPT: case OP_ADD_LL: case OP_ADD_LK:
+			arithmetic(as, ip, pc, 0x58, &slow, error_label);
+			break;
+		case OP_SUB: case OP_SUB_NUM: case OP_SUB_DEOPT: case OP_SUB_LL: case OP_SUB_LK:
+			arithmetic(as, ip, pc, 0x5C, &slow, error_label);
+			break;
+		case OP_MUL: case OP_MUL_NUM: case OP_MUL_DEOPT: case OP_MUL_LL: case OP_MUL_LK:
+			arithmetic(as, ip, pc, 0x59, &slow, error_label);
+			break;
+		case OP_DIV: case OP_DIV_NUM: case OP_DIV_DEOPT: case OP_DIV_LL: case OP_DIV_LK:
+			arithmetic(as, ip, pc, 0x5E, &slow, error_label);
+			break;
+		case OP_LT: case OP_LT_NUM: case OP_LT_DEOPT: case OP_LT_LK:
+		case OP_LTE: case OP_LTE_NUM: case OP_LTE_DEOPT: case OP_LTE_LK:
+		case OP_GT: case OP_GT_NUM: case OP_GT_DEOPT: case OP_GT_LK:
+		case OP_GTE: case OP_GTE_NUM: case OP_GTE_DEOPT: case OP_GTE_LK:
+			comparison(as, ip, pc, &slow, error_label);
+			break;
+		case OP_LT_JUMP_IF: case OP_LTE_JUMP_IF: case OP_GT_JUMP_IF: case OP_GTE_JUMP_IF:
+		case OP_LT_LL_JUMP_IF: case OP_LTE_LL_JUMP_IF: case OP_GT_LL_JUMP_IF: case OP_GTE_LL_JUMP_IF:
+		case OP_LT_LK_JUMP_IF: case OP_LTE_LK_JUMP_IF: case OP_GT_LK_JUMP_IF: case OP_GTE_LK_JUMP_IF:
+			compare_and_jump(as, ip, pc, at + ip->arg, &slow, error_label);
+			break;
+		case OP_EQ_JUMP_IF: case OP_NEQ_JUMP_IF:
+			call_runtime(as, pc, error_label);
+			jump_if_false(as, at + ip->arg, error_label);
+			break;
+		case OP_CALL:
+			mov_imm(as, RSI, (uint8_t)ip->arg);
+			call_helper(as, (void*)&jit_call);
+			check_helper(as, error_label);
+			break;
+		case OP_RETURN:
+			mov_imm(as, RSI, ip->arg);
+			call_helper(as, (void*)&pop_frame);
+			jump_to(as, -1, return_label);
+			break;
+		case OP_TAIL_CALL:
+			// The helper decides what the caller of the machine code does next
+			mov_imm(as, RSI, (uint8_t)ip->arg);
+			call_helper(as, (void*)&jit_tail_call);
+			jump_to(as, -1, exit_label);
+			break;
+		case OP_PUSH: case OP_STORE_UP:
+		case OP_INC: case OP_DEC: case OP_NEG: case OP_NOT:
+		case OP_EQ: case OP_NEQ: case OP_CMP: case OP_AND: case OP_OR:
+		case OP_GETG: case OP_GETG_SLOT: case OP_SETG_SLOT: case OP_GETP:
+		case OP_CLOSE: case OP_INVOKE:
+			call_runtime(as, pc, error_label);
+			break;
+		default:
+			// Leave functions using unimplemented instructions to the interpreter
+			buffer_free(&slow);
+			return false;
+		}
+	}
+	buffer_free(&slow);
+
+	// Running off the end of the code is an error, as is a jump there
+	as->labels[size] = as->labels[error_label] = as->size;
+	emit8(as, 0xB8);
+	emit32(as, JIT_ERROR);
+	jump_to(as, -1, exit_label);
+	as->labels[return_label] = as->size;
+	emit8(as, 0xB8);
+	emit32(as, JIT_RETURNED);
+	as->labels[exit_label] = as->size;
+
+	ADD_IMM(as, RSP, 8);
+	for (int reg = R15; reg >= R12; --reg) {
+		emit8(as, 0x41);
+		emit8(as, 0x58 + (reg & 7));
+	}
+	emit8(as, 0x5D);
+	emit8(as, 0x5B);
+	emit8(as, 0xC3);
+	if (as->failed)
+		return false;
+
+	buffer_foreach(as->fixups, fixup_t, fixup) {
+		int32_t offset = as->labels[fixup->label] - (fixup->at + 4);
+		memcpy(as->code + fixup->at, &offset, 4);
+	}
+	return true;
+}
+
+bool jit_compile(vm_t* vm, function_t* fn)
+{
+	// Traces need every instruction to go through the interpreter
+	if (vm->debug || fn->compiled.registers)
+		return false;
+
+	assembler_t as = { 0 };
+	as.labels = ALLOC((fn->compiled.code.size + 4) * sizeof(size_t));
+	as.fixups = buffer_new(sizeof(fixup_t));
+
+	bool translated = as.labels && translate(&as, fn);
+	if (translated) {
+		void* code = mmap(NULL, as.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (code == MAP_FAILED) {
+			translated = false;
+		} else {
+			memcpy(code, as.code, as.size);
+			// Policies forbidding executable mappings leave the function to
+			// the interpreter
+			if (mprotect(code, as.size, PROT_READ | PROT_EXEC) != 0) {
+				munmap(code, as.size);
+				translated = false;
+			} else {
+				fn->compiled.jit = code;
+				fn->compiled.jit_size = as.size;
+			}
+		}
+	}
+
+	FREE(as.code);
+	FREE(as.labels);
+	buffer_free(&as.fixups);
+	return translated;
+}
+
+void jit_free(function_t* fn)
+{
+	if (fn->compiled.jit)
+		munmap(fn->compiled.jit, fn->compiled.jit_size);
+	fn->compiled.jit = NULL;
+}
+
+bool jit_enter(vm_t* vm, frame_t* f)
+{
+	jit_status_t status;
+	while ((status = ((jit_status_t (*)(vm_t*, frame_t*))f->callee->compiled.jit)(vm, f)) == JIT_TAIL_CALLED) {
+		// The frame was replaced by the one of the tail callee
+		f = &vm->frames[vm->frame_count - 1];
+		if (!jit_ready(vm, f->callee))
+			return interpret_frame(vm, f - vm->frames);
+	}
+	return status == JIT_RETURNED;
+}
+
+#else
+
+bool jit_compile(vm_t* vm, function_t* fn)
+{
+	(void)vm;
+	(void)fn;
+	return false;
+}
+
+void jit_free(function_t* fn)
+{
+	(void)fn;
+}
+
+bool jit_enter(vm_t* vm, frame_t* f)
+{
+	(void)vm;
+	(void)f;
+	return false;
+}
+
+#endif
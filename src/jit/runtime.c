@@ -0,0 +1,248 @@
+#include <assert.h>
+#include "jit/jit.h"
+#include "vm.h"
+#include "vm/interpreter.h"
+
+// Call `callee` with the `argc` arguments on top of the stack, leaving its
+// return value there like OP_CALL.
+static bool call(vm_t* vm, value_t callee, uint8_t argc)
+{
+	if (is_native(callee))
+		return call_native(vm, AS_FUNCTION(callee), argc) >= 0;
+
+	size_t base = vm->frame_count;
+	frame_t* f = push_frame(vm, callee, argc);
+	if (!f)
+		return false;
+	// Stay in machine code when the callee has some
+	if (f->callee->compiled.jit) {
+		if (jit_enter(vm, f))
+			return true;
+		vm->sp = vm->stack + f->stack_start;
+		vm->frame_count = base;
+		return false;
+	}
+	return interpret_frame(vm, base);
+}
+
+bool jit_call(vm_t* vm, uint8_t argc)
+{
+	return call(vm, vm_pop(vm), argc);
+}
+
+jit_status_t jit_tail_call(vm_t* vm, uint8_t argc)
+{
+	value_t callee = vm_pop(vm);
+	if (is_native(callee)) {
+		int8_t n_returned = call_native(vm, AS_FUNCTION(callee), argc);
+		if (n_returned < 0)
+			return JIT_ERROR;
+		if (n_returned == 0)
+			vm_push(vm, VALUE_NULL);
+		pop_frame(vm, 1);
+		return JIT_RETURNED;
+	}
+	return replace_frame(vm, callee, argc) ? JIT_TAIL_CALLED : JIT_ERROR;
+}
+
+// The instruction a fused or quickened one derives from
+static op_code_t base_op(op_code_t op)
+{
+	switch (op) {
+	case OP_ADD_NUM: case OP_ADD_DEOPT: case OP_ADD_LL: case OP_ADD_LK: return OP_ADD;
+	case OP_SUB_NUM: case OP_SUB_DEOPT: case OP_SUB_LL: case OP_SUB_LK: return OP_SUB;
+	case OP_MUL_NUM: case OP_MUL_DEOPT: case OP_MUL_LL: case OP_MUL_LK: return OP_MUL;
+	case OP_DIV_NUM: case OP_DIV_DEOPT: case OP_DIV_LL: case OP_DIV_LK: return OP_DIV;
+	case OP_LT_NUM: case OP_LT_DEOPT: case OP_LT_LK: case OP_LT_JUMP_IF:
+	case OP_LT_LL_JUMP_IF: case OP_LT_LK_JUMP_IF: return OP_LT;
+	case OP_LTE_NUM: case OP_LTE_DEOPT: case OP_LTE_LK: case OP_LTE_JUMP_IF:
+	case OP_LTE_LL_JUMP_IF: case OP_LTE_LK_JUMP_IF: return OP_LTE;
+	case OP_GT_NUM: case OP_GT_DEOPT: case OP_GT_LK: case OP_GT_JUMP_IF:
+	case OP_GT_LL_JUMP_IF: case OP_GT_LK_JUMP_IF: return OP_GT;
+	case OP_GTE_NUM: case OP_GTE_DEOPT: case OP_GTE_LK: case OP_GTE_JUMP_IF:
+	case OP_GTE_LL_JUMP_IF: case OP_GTE_LK_JUMP_IF: return OP_GTE;
+	case OP_EQ_JUMP_IF: return OP_EQ;
+	case OP_NEQ_JUMP_IF: return OP_NEQ;
+	default: return op;
+	}
+}
+
+// Fused compare-and-branch instructions only push the result of the comparison
+// here, the machine code takes the branch.
+bool jit_execute(vm_t* vm, frame_t* f, uint8_t* start)
+{
+	op_t op, *ip = &op;
+	f->ip = (uint8_t*)op_decode(start, &op);
+	value_t* slots = vm->stack + f->stack_start;
+	value_t* constants = f->callee->compiled.constants.data;
+	value_t* captures = f->callee->compiled.captures.data;
+
+	// Operands of binary operators
+	value_t a, b;
+	switch (ip->op) {
+	case OP_ADD_LL: case OP_SUB_LL: case OP_MUL_LL: case OP_DIV_LL:
+	case OP_LT_LL_JUMP_IF: case OP_LTE_LL_JUMP_IF: case OP_GT_LL_JUMP_IF: case OP_GTE_LL_JUMP_IF:
+		a = slots[OP_ARG_B(op_byte_args(ip))];
+		b = slots[OP_ARG_A(op_byte_args(ip))];
+		break;
+	case OP_ADD_LK: case OP_SUB_LK: case OP_MUL_LK: case OP_DIV_LK:
+	case OP_LT_LK: case OP_LTE_LK: case OP_GT_LK: case OP_GTE_LK:
+	case OP_LT_LK_JUMP_IF: case OP_LTE_LK_JUMP_IF: case OP_GT_LK_JUMP_IF: case OP_GTE_LK_JUMP_IF:
+		a = slots[OP_ARG_B(op_byte_args(ip))];
+		b = constants[OP_ARG_A(op_byte_args(ip))];
+		break;
+	case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_CMP:
+	case OP_GT: case OP_GTE: case OP_LT: case OP_LTE: case OP_EQ: case OP_NEQ:
+	case OP_AND: case OP_OR:
+	case OP_ADD_NUM: case OP_SUB_NUM: case OP_MUL_NUM: case OP_DIV_NUM:
+	case OP_GT_NUM: case OP_GTE_NUM: case OP_LT_NUM: case OP_LTE_NUM:
+	case OP_ADD_DEOPT: case OP_SUB_DEOPT: case OP_MUL_DEOPT: case OP_DIV_DEOPT:
+	case OP_GT_DEOPT: case OP_GTE_DEOPT: case OP_LT_DEOPT: case OP_LTE_DEOPT:
+	case OP_EQ_JUMP_IF: case OP_NEQ_JUMP_IF:
+	case OP_LT_JUMP_IF: case OP_LTE_JUMP_IF: case OP_GT_JUMP_IF: case OP_GTE_JUMP_IF:
+		a = vm_pop(vm);
+		b = vm_pop(vm);
+		break;
+	default:
+		a = b = VALUE_NULL;
+		break;
+	}
+
+#define NUMBERS(name) \
+	if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+		runtime_error(vm, "operand of " #name " is not a Number"); \
+		return false; \
+	}
+#define LOGICAL(name) \
+	if (!IS_BOOL(a) || !IS_BOOL(b)) { \
+		runtime_error(vm, "operand of " #name " is not a Bool"); \
+		return false; \
+	}
+
+	switch (base_op(ip->op)) {
+	case OP_NOP:
+		return true;
+	case OP_PUSH:
+		for (int32_t i = 0; i < ip->arg; ++i)
+			vm_push(vm, VALUE_NULL);
+		return true;
+	case OP_LOAD_UP:
+		vm_push(vm, captures[ip->arg]);
+		return true;
+	case OP_STORE_UP:
+		captures[ip->arg] = vm_pop(vm);
+		vm_gc_barrier(vm, &f->callee->header, captures[ip->arg]);
+		return true;
+	case OP_ADD: { NUMBERS(ADD) vm_push(vm, VALUE_NUMBER(AS_NUMBER(a) + AS_NUMBER(b))); return true; }
+	case OP_SUB: { NUMBERS(SUB) vm_push(vm, VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b))); return true; }
+	case OP_MUL: { NUMBERS(MUL) vm_push(vm, VALUE_NUMBER(AS_NUMBER(a) * AS_NUMBER(b))); return true; }
+	case OP_DIV: { NUMBERS(DIV) vm_push(vm, VALUE_NUMBER(AS_NUMBER(a) / AS_NUMBER(b))); return true; }
+	case OP_CMP: { NUMBERS(CMP) vm_push(vm, VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b))); return true; }
+	case OP_GT: { NUMBERS(GT) vm_push(vm, VALUE_BOOL(AS_NUMBER(a) > AS_NUMBER(b))); return true; }
+	case OP_GTE: { NUMBERS(GTE) vm_push(vm, VALUE_BOOL(AS_NUMBER(a) >= AS_NUMBER(b))); return true; }
+	case OP_LT: { NUMBERS(LT) vm_push(vm, VALUE_BOOL(AS_NUMBER(a) < AS_NUMBER(b))); return true; }
+	case OP_LTE: { NUMBERS(LTE) vm_push(vm, VALUE_BOOL(AS_NUMBER(a) <= AS_NUMBER(b))); return true; }
+	case OP_AND: { LOGICAL(AND) vm_push(vm, VALUE_BOOL(AS_BOOL(a) && AS_BOOL(b))); return true; }
+	case OP_OR: { LOGICAL(OR) vm_push(vm, VALUE_BOOL(AS_BOOL(a) || AS_BOOL(b))); return true; }
+	case OP_EQ:
+		vm_push(vm, VALUE_BOOL(value_equals(a, b)));
+		return true;
+	case OP_NEQ:
+		vm_push(vm, VALUE_BOOL(!value_equals(a, b)));
+		return true;
+	case OP_INC:
+	case OP_DEC:
+	case OP_NEG: {
+		a = vm_pop(vm);
+		if (!IS_NUMBER(a)) {
+			runtime_error(vm, "operand of %s is not a Number", ip->op == OP_INC ? "INC" : ip->op == OP_DEC ? "DEC" : "NEG");
+			return false;
+		}
+		double n = AS_NUMBER(a);
+		vm_push(vm, VALUE_NUMBER(ip->op == OP_INC ? n + 1 : ip->op == OP_DEC ? n - 1 : -n));
+		return true;
+	}
+	case OP_NOT:
+		a = vm_pop(vm);
+		if (!IS_BOOL(a)) {
+			runtime_error(vm, "operand of NOT is not a Bool");
+			return false;
+		}
+		vm_push(vm, VALUE_BOOL(!AS_BOOL(a)));
+		return true;
+	case OP_GETG: {
+		value_t key = vm_pop(vm);
+		value_t value = table_get(vm->global, key);
+		if (value == VALUE_NULL) {
+			runtime_error(vm, "undefined variable '%s'", AS_STRING(key)->data);
+			return false;
+		}
+		vm_push(vm, value);
+		return true;
+	}
+	case OP_GETG_SLOT: {
+		global_slot_t* slot = &((global_slot_t*)vm->global_slots.data)[ip->arg];
+		if (slot->version != vm->global->version) {
+			slot->value = table_get(vm->global, slot->name);
+			slot->version = vm->global->version;
+		}
+		if (slot->value == VALUE_NULL) {
+			runtime_error(vm, "undefined variable '%s'", AS_STRING(slot->name)->data);
+			return false;
+		}
+		vm_push(vm, slot->value);
+		return true;
+	}
+	case OP_SETG_SLOT: {
+		global_slot_t* slot = &((global_slot_t*)vm->global_slots.data)[ip->arg];
+		table_set(vm, vm->global, slot->name, vm->sp[-1]);
+		slot->value = vm->sp[-1];
+		slot->version = vm->global->version;
+		return true;
+	}
+	case OP_GETP:
+	case OP_INVOKE: {
+		value_t this = vm_pop(vm);
+		value_t prop_name = vm_pop(vm);
+		assert(IS_STRING(prop_name));
+		class_t* class = get_class(vm, this);
+		assert(class);
+		size_t cache_index = ip->op == OP_INVOKE ? OP_ARG_A(ip->arg) : (size_t)ip->arg;
+		inline_cache_t* cache = &((inline_cache_t*)f->callee->compiled.caches.data)[cache_index];
+		value_t prop_value = get_property(vm, f->callee, cache, class, prop_name);
+		if (prop_value == VALUE_NULL) {
+			runtime_error(vm, "undefined property '%s' on value of type '%s'", AS_STRING(prop_name)->data, class->name->data);
+			return false;
+		}
+		bool method = ip->op == OP_INVOKE || f->ip[op_length(OP_GETP)] == OP_CALL || f->ip[op_length(OP_GETP)] == OP_TAIL_CALL;
+		if (IS_FUNCTION(prop_value) && method)
+			vm_push(vm, this);
+		if (ip->op == OP_GETP) {
+			vm_push(vm, prop_value);
+			return true;
+		}
+		return call(vm, prop_value, OP_ARG_B(ip->arg));
+	}
+	case OP_CLOSE: {
+		function_t* fn = AS_FUNCTION(vm_pop(vm));
+		for (int i = 0; i < ip->arg; ++i) {
+			value_t upv = vm_pop(vm);
+			vm_gc_barrier(vm, &fn->header, upv);
+			if (!value_vector_push(&fn->compiled.captures, upv))
+				vm_out_of_memory(vm);
+		}
+		vm_push(vm, VALUE_OBJECT(fn));
+		return true;
+	}
+	case OP_JUMP_IF:
+		// Only reached when the condition is not a boolean
+		runtime_error(vm, "condition did not result in a boolean");
+		return false;
+	default:
+		runtime_error(vm, "unimplemented op code %d", ip->op);
+		return false;
+	}
+
+#undef LOGICAL
+#undef NUMBERS
+}
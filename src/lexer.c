@@ -78,7 +78,7 @@ static inline bool fast_strncmp(const char* a, const char* b, size_t sa, size_t
 	return strncmp(a, b, sa < sb ? sa : sb) == 0;
 }
 
-static token_t identifier(lexer_t* l)
+static token_t identifier(vm_t* vm, lexer_t* l)
 {
 	const char* start = l->current;
 	token_t t = TOKEN(TOKEN_IDENTIFIER);
@@ -107,19 +107,24 @@ static token_t identifier(lexer_t* l)
 
 	// insert a new identifier
 	identifier_t id = { ALLOC(length + 1), 1 };
+	if (!id.name)
+		vm_out_of_memory(vm);
 	strncpy(id.name, start, length);
-	buffer_push(&l->identifiers, &id);
+	if (!buffer_push(&l->identifiers, &id)) {
+		FREE(id.name);
+		vm_out_of_memory(vm);
+	}
 	t.index = l->identifiers.size - 1;
 	return t;
 }
 
-static token_t number(lexer_t* l)
+static token_t number(vm_t* vm, lexer_t* l)
 {
 	char* end = (char*)l->current;
 	token_t t = TOKEN(TOKEN_NUMBER);
 	literal_t lit = { .number = strtod(l->current, &end) };
 	l->current = end;
-	buffer_push(&l->literals, &lit);
+	vm_buffer_push(vm, &l->literals, &lit);
 	t.index = l->literals.size - 1;
 	return t;
 }
@@ -140,7 +145,7 @@ static token_t string(vm_t* vm, lexer_t* l)
 	}
 
 	literal_t lit = { .string = { .start = start, .length = l->current - start } };
-	buffer_push(&l->literals, &lit);
+	vm_buffer_push(vm, &l->literals, &lit);
 	t.index = l->literals.size - 1;
 
 	// Skip the closing quote
@@ -327,11 +332,11 @@ token_t lexer_next(vm_t* vm, lexer_t* l)
 	}
 
 	if (isalpha(peek(l)) || peek(l) == '_') {
-		return identifier(l);
+		return identifier(vm, l);
 	}
 
 	if (isdigit(peek(l)) || (peek(l) == '.' && isdigit(l->current[1]))) {
-		return number(l);
+		return number(vm, l);
 	}
 
 	if (peek(l) == '"') {
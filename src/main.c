@@ -8,31 +8,61 @@
 #include "std.h"
 #include "vm.h"
 
-static const char* g_short_options = "d";
+static const char* g_short_options = "c:dg:j:m:n:rs:t:ST";
 static const struct option g_long_options[] = {
+	{"gc-compact", required_argument, NULL, 'c'},
 	{"debug", no_argument, NULL, 'd'},
+	{"gc-threshold", required_argument, NULL, 'g'},
+	{"jit-threshold", required_argument, NULL, 'j'},
+	{"heap-limit", required_argument, NULL, 'm'},
+	{"gc-nursery", required_argument, NULL, 'n'},
+	{"registers", no_argument, NULL, 'r'},
+	{"gc-step", required_argument, NULL, 's'},
+	{"gc-threads", required_argument, NULL, 't'},
+	{"gc-stats", no_argument, NULL, 'S'},
+	{"gc-trace", no_argument, NULL, 'T'},
 	{NULL, 0, NULL, 0}
 };
 
-static array_t* make_argv(vm_t* vm)
+static bool g_gc_stats = false;
+
+// Arguments are built on the stack, where they are safe from collections
+static void push_argv(vm_t* vm)
 {
 	array_t* args = new_array(vm);
-	for (char** arg = vm->arguments; *arg != NULL; ++arg) {
-		value_t val = VALUE_OBJECT(new_string(vm, *arg));
-		buffer_push(&args->values, &val);
-	}
-	return args;
+	vm_push(vm, VALUE_OBJECT(args));
+	for (char** arg = vm->arguments; *arg != NULL; ++arg)
+		array_push(vm, args, VALUE_OBJECT(new_string(vm, *arg)));
 }
 
-static table_t* make_env(vm_t* vm)
+static void push_env(vm_t* vm)
 {
 	table_t* env = new_table(vm);
+	vm_push(vm, VALUE_OBJECT(env));
 	for (char** e = vm->environment; *e != NULL; ++e) {
-		value_t key = VALUE_OBJECT(new_string(vm, strtok(*e, "=")));
+		vm_push(vm, VALUE_OBJECT(new_string(vm, strtok(*e, "="))));
 		value_t value = VALUE_OBJECT(new_string(vm, strtok(NULL, "")));
-		table_set(env, key, value);
+		table_set(vm, env, vm_pop(vm), value);
 	}
-	return env;
+}
+
+// Passes the arguments `main` takes, it is on top of the stack
+static void push_arguments(vm_t* vm, void* data)
+{
+	function_t* main = data;
+	if (main->arity >= 1) {
+		push_argv(vm);
+
+		if (main->arity >= 2) {
+			push_env(vm);
+		}
+	}
+}
+
+static void open_std(vm_t* vm, void* data)
+{
+	(void)data;
+	vm_std_all(vm);
 }
 
 static char* read_file(const char* filename)
@@ -65,16 +95,13 @@ static void do_file(vm_t* vm)
 
 	vm_interpret(vm, res, 0);
 
+	// Left below the arguments to keep it alive while they are built
 	value_t main = vm_pop(vm);
-	vm->stack.size = 0;
+	vm->sp = vm->stack;
+	vm_push(vm, main);
 
-	if (AS_FUNCTION(main)->arity >= 1) {
-		vm_push(vm, VALUE_OBJECT(make_argv(vm)));
-
-		if (AS_FUNCTION(main)->arity >= 2) {
-			vm_push(vm, VALUE_OBJECT(make_env(vm)));
-		}
-	}
+	if (!vm_protect(vm, push_arguments, AS_FUNCTION(main)))
+		return;
 
 	vm_interpret(vm, main, AS_FUNCTION(main)->arity);
 }
@@ -84,9 +111,39 @@ static bool parse_options(vm_t *vm, int argc, char **argv)
 	int opt = -1;
 	while ((opt = getopt_long(argc, argv, g_short_options, g_long_options, NULL)) != -1) {
 		switch (opt) {
+		case 'c':
+			vm->gc_compact_ratio = strtoul(optarg, NULL, 10);
+			break;
 		case 'd':
 			vm->debug = true;
 			break;
+		case 'g':
+			vm->gc_threshold = vm->gc_next = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			vm->jit_threshold = strtoul(optarg, NULL, 10);
+			break;
+		case 'm':
+			vm->gc_limit = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			vm->gc_nursery = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			vm->backend = BACKEND_REGISTER;
+			break;
+		case 's':
+			vm->gc_step_work = strtoul(optarg, NULL, 10);
+			break;
+		case 't':
+			vm->gc_mark_threads = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			g_gc_stats = true;
+			break;
+		case 'T':
+			vm->gc_trace = true;
+			break;
 		default:
 			fprintf(stderr, "Unknown option %c (%d)\n", opt, opt);
 			break;
@@ -94,7 +151,7 @@ static bool parse_options(vm_t *vm, int argc, char **argv)
 	}
 
 	if (optind >= argc) {
-		fprintf(stderr, "usage: %s [-d|--debug] <entry-point> -- [arguments...]\n", argv[0]);
+		fprintf(stderr, "usage: %s [-c|--gc-compact <percent>] [-d|--debug] [-g|--gc-threshold <bytes>] [-j|--jit-threshold <calls>] [-m|--heap-limit <bytes>] [-n|--gc-nursery <bytes>] [-r|--registers] [-s|--gc-step <objects>] [-t|--gc-threads <threads>] [-S|--gc-stats] [-T|--gc-trace] <entry-point> -- [arguments...]\n", argv[0]);
 		return false;
 	}
 
@@ -102,6 +159,35 @@ static bool parse_options(vm_t *vm, int argc, char **argv)
 	return true;
 }
 
+static void print_gc_stats(vm_t* vm)
+{
+	static const char* type_names[OBJECT_TYPE_COUNT] = {
+		[OBJECT_ARRAY] = "Array",
+		[OBJECT_CLASS] = "Class",
+		[OBJECT_FUNCTION] = "Function",
+		[OBJECT_INSTANCE] = "Instance",
+		[OBJECT_NATIVE] = "Native",
+		[OBJECT_MODULE] = "Module",
+		[OBJECT_RESOURCE] = "Resource",
+		[OBJECT_STRING] = "String",
+		[OBJECT_TABLE] = "Table",
+	};
+
+	gc_stats_t stats;
+	vm_gc_stats(vm, &stats);
+	fprintf(stderr, "gc: %zu major and %zu minor collections, paused %.3f ms in total, %.3f ms at most\n",
+		stats.major_collections, stats.minor_collections, stats.total_pause / 1e6, stats.max_pause / 1e6);
+	if (stats.compactions > 0)
+		fprintf(stderr, "gc: %zu compactions\n", stats.compactions);
+	fprintf(stderr, "gc: freed %zu objects, %zu bytes\n", stats.freed_objects, stats.freed_bytes);
+	for (size_t i = 0; i < OBJECT_TYPE_COUNT; ++i) {
+		if (stats.objects[i] > 0)
+			fprintf(stderr, "gc: %-9s %8zu objects %10zu bytes\n", type_names[i], stats.objects[i], stats.bytes[i]);
+	}
+	fprintf(stderr, "gc: string pool of %zu buckets, %zu strings and %zu tombstones\n",
+		stats.string_buckets, stats.strings, stats.string_tombstones);
+}
+
 static void error(const char* msg)
 {
 	fprintf(stderr, "lang error: %s\n", msg);
@@ -110,7 +196,12 @@ static void error(const char* msg)
 int main(int argc, char** argv, char** environment)
 {
 	vm_t *vm = vm_open(environment, &error);
-	vm_std_all(vm);
+	if (!vm)
+		return EXIT_FAILURE;
+	if (!vm_protect(vm, open_std, NULL)) {
+		vm_destroy(vm);
+		return EXIT_FAILURE;
+	}
 
 	if (!parse_options(vm, argc, argv)) {
 		vm_destroy(vm);
@@ -119,6 +210,8 @@ int main(int argc, char** argv, char** environment)
 
 	do_file(vm);
 
+	if (g_gc_stats)
+		print_gc_stats(vm);
 	vm_destroy(vm);
 	return EXIT_SUCCESS;
 }
@@ -1,40 +1,138 @@
 #include <assert.h>
 #include <string.h>
+#include "jit/jit.h"
 #include "vm.h"
 
 // Objects ---------------------------------------------------------------------
 
+// Accounts for a new object, which may run a collection or a slice of one
+// beforehand: the block is left out of it, as is the object until linked by
+// `init_header`. The objects its constructor holds must be rooted.
+static void* allocate(vm_t* vm, size_t size)
+{
+	vm_gc_reserve(vm, size);
+	vm->gc_allocated += size;
+	vm->gc_young_allocated += size;
+	if (vm->gc_phase != GC_IDLE || vm->gc_allocated > vm->gc_next)
+		vm_gc_step(vm);
+	else if (vm->gc_nursery > 0 && vm->gc_young_allocated > vm->gc_nursery)
+		vm_gc_collect_young(vm);
+
+	void* block = allocator_alloc(&vm->allocator, size);
+	if (!block) {
+		vm->gc_allocated -= size;
+		vm->gc_young_allocated -= size;
+		vm_out_of_memory(vm);
+	}
+	return block;
+}
+
 static void init_header(vm_t* vm, object_t* obj, object_type_t type, class_t* class)
 {
 	obj->type = type;
-	obj->gc_bit = false;
 	obj->class = class;
-	obj->next = vm->heap;
-	vm->heap = obj;
+	vm->gc_stats.objects[type]++;
+	vm->gc_stats.bytes[type] += object_size(obj);
+
+	// Constructors fill objects in without barriers, so the ones allocated
+	// while marking are scanned once the cycle gets to them
+	obj->gc_remembered = false;
+	if (vm->gc_phase == GC_MARK)
+		vm_gc_shade(vm, obj);
+
+	obj->next = vm->young;
+	vm->young = obj;
+}
+
+// Bytes accounted for an object, its buffers are not included
+size_t object_size(object_t* obj)
+{
+	switch (obj->type) {
+	case OBJECT_ARRAY: return sizeof(array_t);
+	case OBJECT_CLASS: return sizeof(class_t);
+	case OBJECT_FUNCTION: return sizeof(function_t);
+	case OBJECT_STRING: return sizeof(string_t) + ((string_t*)obj)->length + 1;
+	case OBJECT_TABLE: return sizeof(table_t);
+	default: return sizeof(object_t);
+	}
+}
+
+// Bytes of the vectors of `obj` accounted in `vm->gc_buffer_bytes`
+size_t object_buffers_size(object_t* obj)
+{
+	switch (obj->type) {
+	case OBJECT_ARRAY:
+		return ((array_t*)obj)->values.capacity * sizeof(value_t);
+	case OBJECT_TABLE: {
+		size_t size = 0;
+		for (size_t i = 0; i < TABLE_CAPACITY; ++i)
+			size += ((table_t*)obj)->buckets[i].capacity * sizeof(table_pair_t);
+		return size;
+	}
+	default: return 0;
+	}
+}
+
+// Accounts for `bytes` more of storage for `owner`. That may run an emergency
+// collection, the `count` values about to be stored are kept alive through it.
+static void grow_storage(vm_t* vm, object_t* owner, size_t bytes, value_t* values, size_t count)
+{
+	if (vm->gc_limit > 0) {
+		size_t scope = vm_open_handles(vm);
+		vm_handle(vm, VALUE_OBJECT(owner));
+		for (size_t i = 0; i < count; ++i)
+			vm_handle(vm, values[i]);
+		vm_gc_reserve(vm, bytes);
+		vm_close_handles(vm, scope);
+	}
+	vm->gc_buffer_bytes += bytes;
 }
 
 // Array -----------------------------------------------------------------------
 
 array_t* new_array(vm_t* vm)
 {
-	array_t* array = ALLOC(sizeof(array_t));
+	array_t* array = allocate(vm, sizeof(array_t));
 	init_header(vm, &array->header, OBJECT_ARRAY, vm->array_class);
-	array->values = buffer_new(sizeof(value_t));
 	return array;
 }
 
-array_t* new_array_from(vm_t* vm, buffer_t* values)
+array_t* new_array_from(vm_t* vm, value_t* values, size_t count)
 {
 	array_t* array = new_array(vm);
-	for (size_t i = 0; i < values->size; ++i)
-		buffer_push(&array->values, buffer_at(values, i));
+	for (size_t i = 0; i < count; ++i)
+		array_push(vm, array, values[i]);
 	return array;
 }
 
-void free_array(array_t* array)
+static void grow_values(vm_t* vm, array_t* array, size_t capacity, value_t* pending, size_t count)
+{
+	size_t bytes = (capacity - array->values.capacity) * sizeof(value_t);
+	grow_storage(vm, &array->header, bytes, pending, count);
+	if (!value_vector_reserve(&array->values, capacity)) {
+		vm->gc_buffer_bytes -= bytes;
+		vm_out_of_memory(vm);
+	}
+}
+
+void array_reserve(vm_t* vm, array_t* array, size_t capacity)
+{
+	if (capacity > array->values.capacity)
+		grow_values(vm, array, capacity, NULL, 0);
+}
+
+void array_push(vm_t* vm, array_t* array, value_t value)
+{
+	vm_gc_barrier(vm, &array->header, value);
+	value_vector_t* values = &array->values;
+	if (values->size == values->capacity)
+		grow_values(vm, array, vector_grown_capacity(values->capacity, values->size + 1), &value, 1);
+	values->data[values->size++] = value;
+}
+
+void finalize_array(array_t* array)
 {
-	buffer_free(&array->values);
-	FREE(array);
+	value_vector_free(&array->values);
 }
 
 // String ---------------------------------------------------------------------
@@ -46,27 +144,28 @@ string_t* new_string(vm_t* vm, const char* str)
 
 string_t* new_string_length(vm_t* vm, const char* str, size_t length)
 {
-	string_t** bucket = vm_lookup_string_pool(&vm->string_pool, str, length);
-	assert(bucket != NULL);
-
-	string_t* string = *bucket;
-
-	if (string->length == 0) {
-		// String was just allocated by the pool
-		init_header(vm, &string->header, OBJECT_STRING, vm->string_class);
-		memcpy(string->data, str, length);
-		string->data[length] = 0;
-		string->length = length;
+	string_t* string = vm_lookup_string_pool(&vm->string_pool, str, length);
+	if (string) {
+		// It may be unreachable and waiting to be swept, it is not anymore. The
+		// mark may then outlive the cycle, which only delays its collection.
+		if (vm->gc_phase == GC_SWEEP)
+			allocator_mark(string);
+		if (vm->gc_phase == GC_MARK)
+			vm_gc_shade(vm, &string->header);
+		return string;
 	}
 
+	if (!vm_string_pool_reserve(&vm->string_pool))
+		vm_out_of_memory(vm);
+	string = allocate(vm, sizeof(string_t) + length + 1);
+	string->length = length;
+	init_header(vm, &string->header, OBJECT_STRING, vm->string_class);
+	memcpy(string->data, str, length);
+	string->data[length] = 0;
+	vm_string_pool_insert(&vm->string_pool, string);
 	return string;
 }
 
-void free_string(string_t* string)
-{
-	FREE(string);
-}
-
 bool string_compare(string_t* a, string_t* b)
 {
 	return strncmp(a->data, b->data, a->length < b->length ? a->length : b->length) == 0;
@@ -76,19 +175,19 @@ bool string_compare(string_t* a, string_t* b)
 
 function_t* new_function(vm_t* vm, uint8_t arity)
 {
-	function_t* fn = ALLOC(sizeof(function_t));
+	function_t* fn = allocate(vm, sizeof(function_t));
 	init_header(vm, &fn->header, OBJECT_FUNCTION, vm->function_class);
 	fn->type = FUNCTION_COMPILED;
 	fn->arity = arity;
-	fn->compiled.code = buffer_new(sizeof(op_t));
-	fn->compiled.constants = buffer_new(sizeof(value_t));
-	fn->compiled.captures = buffer_new(sizeof(value_t));
+	fn->compiled.registers = vm->backend == BACKEND_REGISTER;
+	fn->compiled.code = buffer_new(fn->compiled.registers ? sizeof(reg_op_t) : sizeof(op_t));
+	fn->compiled.caches = buffer_new(sizeof(inline_cache_t));
 	return fn;
 }
 
 function_t* new_native_function(vm_t* vm, native_fn_t native, uint8_t arity)
 {
-	function_t* fn = ALLOC(sizeof(function_t));
+	function_t* fn = allocate(vm, sizeof(function_t));
 	init_header(vm, &fn->header, OBJECT_FUNCTION, vm->function_class);
 	fn->type = FUNCTION_NATIVE;
 	fn->arity = arity;
@@ -96,28 +195,22 @@ function_t* new_native_function(vm_t* vm, native_fn_t native, uint8_t arity)
 	return fn;
 }
 
-void free_function(function_t* fn)
+void finalize_function(function_t* fn)
 {
 	if (fn->type == FUNCTION_COMPILED) {
 		buffer_free(&fn->compiled.code);
-		buffer_free(&fn->compiled.constants);
-		buffer_free(&fn->compiled.captures);
+		value_vector_free(&fn->compiled.constants);
+		value_vector_free(&fn->compiled.captures);
+		buffer_free(&fn->compiled.caches);
+		jit_free(fn);
 	}
-	FREE(fn);
 }
 
 // Table -----------------------------------------------------------------------
 
-static table_pair_t* get_pair(table_t* table, value_t key, bool should_allocate)
+static table_pair_t* get_pair(table_t* table, value_t key)
 {
-	uint64_t index = value_hash(key) % TABLE_CAPACITY;
-	buffer_t* bucket = &table->buckets[index];
-
-	if (should_allocate && bucket->element_size == 0) {
-		*bucket = buffer_new(sizeof(table_pair_t));
-	}
-
-	buffer_foreach(*bucket, table_pair_t, p) {
+	vector_foreach(table->buckets[value_hash(key) % TABLE_CAPACITY], p) {
 		if (value_equals(p->key, key))
 			return p;
 	}
@@ -126,40 +219,94 @@ static table_pair_t* get_pair(table_t* table, value_t key, bool should_allocate)
 
 table_t* new_table(vm_t* vm)
 {
-	table_t* table = ALLOC(sizeof(table_t));
+	table_t* table = allocate(vm, sizeof(table_t));
 	init_header(vm, &table->header, OBJECT_TABLE, vm->table_class);
 	return table;
 }
 
-void free_table(table_t* table)
+table_t* new_weak_table(vm_t* vm, table_mode_t mode)
 {
+	table_t* table = new_table(vm);
+	// Only registered tables are weak, finalizing one unregisters it
+	if (mode != TABLE_STRONG)
+		vm_buffer_push(vm, &vm->gc_weak_tables, &table);
+	table->mode = mode;
+	return table;
+}
+
+void finalize_table(vm_t* vm, table_t* table)
+{
+	if (table->mode != TABLE_STRONG) {
+		table_t** tables = vm->gc_weak_tables.data;
+		for (size_t i = 0; i < vm->gc_weak_tables.size; ++i) {
+			if (tables[i] == table) {
+				tables[i] = tables[--vm->gc_weak_tables.size];
+				break;
+			}
+		}
+	}
 	for (size_t i = 0; i < TABLE_CAPACITY; ++i)
-		buffer_free(&table->buckets[i]);
-	FREE(table);
+		pair_vector_free(&table->buckets[i]);
 }
 
 value_t table_get(table_t* table, value_t key)
 {
-	table_pair_t* p = get_pair(table, key, false);
+	table_pair_t* p = get_pair(table, key);
 	return p ? p->value : VALUE_NULL;
 }
 
-void table_set(table_t* table, value_t key, value_t value)
+void table_set(vm_t* vm, table_t* table, value_t key, value_t value)
 {
-	table_pair_t* p = get_pair(table, key, true);
+	vm_gc_barrier(vm, &table->header, key);
+	vm_gc_barrier(vm, &table->header, value);
+	table->version++;
+
+	table_pair_t* p = get_pair(table, key);
 	if (p != NULL) {
 		p->value = value;
 		return;
 	}
 
-	uint64_t index = value_hash(key) % TABLE_CAPACITY;
+	pair_vector_t* bucket = &table->buckets[value_hash(key) % TABLE_CAPACITY];
 	table_pair_t pair = { key, value };
-	buffer_push(&table->buckets[index], &pair);
+	if (bucket->size == bucket->capacity) {
+		size_t capacity = vector_grown_capacity(bucket->capacity, bucket->size + 1);
+		size_t bytes = (capacity - bucket->capacity) * sizeof(table_pair_t);
+		grow_storage(vm, &table->header, bytes, &pair.key, 2);
+		if (!pair_vector_reserve(bucket, capacity)) {
+			vm->gc_buffer_bytes -= bytes;
+			vm_out_of_memory(vm);
+		}
+	}
+	bucket->data[bucket->size++] = pair;
 }
 
-void table_remove(table_t* table, value_t key)
+void table_remove(vm_t* vm, table_t* table, value_t key)
 {
-	table_set(table, key, VALUE_NULL);
+	table_set(vm, table, key, VALUE_NULL);
+}
+
+// Moves every pair to the bucket of its key's current hash, objects other than
+// strings are hashed by address and may have been moved
+void table_rehash(vm_t* vm, table_t* table)
+{
+	size_t before = object_buffers_size(&table->header);
+	pair_vector_t pairs = { 0 };
+	for (size_t i = 0; i < TABLE_CAPACITY; ++i) {
+		vector_foreach(table->buckets[i], p) {
+			if (!pair_vector_push(&pairs, *p))
+				vm_out_of_memory(vm);
+		}
+		table->buckets[i].size = 0;
+	}
+
+	vector_foreach(pairs, p) {
+		if (!pair_vector_push(&table->buckets[value_hash(p->key) % TABLE_CAPACITY], *p))
+			vm_out_of_memory(vm);
+	}
+	pair_vector_free(&pairs);
+	vm->gc_buffer_bytes += object_buffers_size(&table->header) - before;
+	table->version++;
 }
 
 // Resource --------------------------------------------------------------------
@@ -170,19 +317,22 @@ void table_remove(table_t* table, value_t key)
 
 class_t* new_class(vm_t* vm, class_t* super, string_t* name)
 {
-	class_t* class = ALLOC(sizeof(class_t));
+	// Keep the class and what it refers to on the stack until its table exists
+	vm_push(vm, VALUE_OBJECT(name));
+	if (super) vm_push(vm, VALUE_OBJECT(super));
+	class_t* class = allocate(vm, sizeof(class_t));
 	init_header(vm, &class->header, OBJECT_CLASS, NULL);
 	class->name = name;
 	class->super = super;
-	class->constants = buffer_new(sizeof(value_t));
+	vm_push(vm, VALUE_OBJECT(class));
 	class->properties = new_table(vm);
+	vm->sp -= super ? 3 : 2;
 	return class;
 }
 
-void free_class(class_t* class)
+void finalize_class(class_t* class)
 {
-	buffer_free(&class->constants);
-	FREE(class);
+	value_vector_free(&class->constants);
 }
 
 // Instance --------------------------------------------------------------------
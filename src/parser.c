@@ -72,17 +72,17 @@ static inline bool token_equals(token_t* a, token_t* b) {
 	return a->type == b->type && a->type == TOKEN_IDENTIFIER && a->index == b->index;
 }
 
-static size_t scope_add_local(scope_t* scope, token_t* t)
+static size_t scope_add_local(vm_t* vm, scope_t* scope, token_t* t)
 {
 	buffer_foreach(scope->locals, token_t, it) {
 		if (token_equals(it, t))
 			return NOT_FOUND;
 	}
-	buffer_push(&scope->locals, t);
+	vm_buffer_push(vm, &scope->locals, t);
 	return scope->locals.size - 1;
 }
 
-static size_t scope_find_local_or_upvalue(scope_t* scope, token_t* t)
+static size_t scope_find_local_or_upvalue(vm_t* vm, scope_t* scope, token_t* t)
 {
 	for (size_t i = 0; i < scope->locals.size; ++i) {
 		token_t* test = buffer_at(&scope->locals, i);
@@ -97,9 +97,9 @@ static size_t scope_find_local_or_upvalue(scope_t* scope, token_t* t)
 	}
 
 	if (scope->parent) {
-		size_t index = scope_find_local_or_upvalue(scope->parent, t);
+		size_t index = scope_find_local_or_upvalue(vm, scope->parent, t);
 		if (index != NOT_FOUND) {
-			buffer_push(&scope->upvalues, t);
+			vm_buffer_push(vm, &scope->upvalues, t);
 			return (scope->upvalues.size - 1) | UPVALUE_MASK;
 		}
 	}
@@ -181,11 +181,11 @@ static ast_node_t* block_statement(vm_t* vm, parser_t* p, buffer_t* parameters)
 	EXPECT(LEFT_BRACE, "'{' before block statement");
 
 	scope_t* last_scope = p->scope;
-	ast_node_t* node = make_block(p, parameters);
+	ast_node_t* node = make_block(vm, p, parameters);
 	while (peek(p) != TOKEN_EOF && peek(p) != TOKEN_RIGHT_BRACE) {
 		ast_node_t* stmt = declaration(vm, p);
 		if (!stmt) { free_node(node); node = NULL; break; }
-		buffer_push(&node->block.body, &stmt);
+		vm_buffer_push(vm, &node->block.body, &stmt);
 	}
 	p->scope = last_scope;
 
@@ -246,7 +246,7 @@ static ast_node_t* var_declaration(vm_t* vm, parser_t* p)
 	EXPECT(IDENTIFIER, "identifier after 'var'");
 
 	token_t id = p->previous;
-	if (scope_add_local(p->scope, &id) == NOT_FOUND) {
+	if (scope_add_local(vm, p->scope, &id) == NOT_FOUND) {
 		parse_error(vm, p, "variable '%s' already declared", ((identifier_t*)buffer_at(&p->lexer.identifiers, id.index))->name);
 		return NULL;
 	}
@@ -277,12 +277,12 @@ parser_t parse(vm_t* vm, const char* source, const char* module)
 	parser.lexer = lexer_new(source, module);
 	parser.current = lexer_next(vm, &parser.lexer);
 	parser.scope = NULL;
-	parser.root = make_block(&parser, NULL);
+	parser.root = make_block(vm, &parser, NULL);
 
 	while (!consumes(vm, &parser, TOKEN_EOF)) {
 		ast_node_t* node = declaration(vm, &parser);
 		if (!node) goto fail;
-		buffer_push(&parser.root->block.body, &node);
+		vm_buffer_push(vm, &parser.root->block.body, &node);
 	}
 	return parser;
 
@@ -355,16 +355,16 @@ void parser_dump_node(parser_t* parser, ast_node_t* node, unsigned indent)
 		parser_dump_node(parser, node->function.body, indent + 1);
 		break;
 	case AST_IDENTIFIER:
-		printf("IDENTIFIER %s\n", node->identifier.id->name);
+		printf("IDENTIFIER %s\n", node->identifier.name);
 		break;
 	case AST_LITERAL:
 		if (node->literal.type == TOKEN_STRING)
-			printf("LITERAL \"%.*s\"\n", (int)node->literal.lit->string.length, node->literal.lit->string.start);
+			printf("LITERAL \"%.*s\"\n", (int)node->literal.lit.string.length, node->literal.lit.string.start);
 		else
-			printf("LITERAL %g\n", node->literal.lit->number);
+			printf("LITERAL %g\n", node->literal.lit.number);
 		break;
 	case AST_PROPERTY:
-		printf("PROPERTY (%s) %s\n", token_name(node->property.operator), node->property.name->name);
+		printf("PROPERTY (%s) %s\n", token_name(node->property.operator), node->property.name);
 		parser_dump_node(parser, node->property.lhs, indent + 1);
 		break;
 	case AST_RETURN:
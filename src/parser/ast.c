@@ -9,7 +9,7 @@ static ast_node_t* make_binary(token_type_t op, ast_node_t* lhs, ast_node_t* rhs
 	return node;
 }
 
-static ast_node_t* make_block(parser_t* p, buffer_t* parameters)
+static ast_node_t* make_block(vm_t* vm, parser_t* p, buffer_t* parameters)
 {
 	ast_node_t* node = ALLOC(sizeof(ast_node_t));
 	node->type = AST_BLOCK;
@@ -21,7 +21,7 @@ static ast_node_t* make_block(parser_t* p, buffer_t* parameters)
 	p->scope = node->block.scope;
 	if (parameters) {
 		buffer_foreach(*parameters, token_t, t) {
-			scope_add_local(node->block.scope, t);
+			scope_add_local(vm, node->block.scope, t);
 		}
 	}
 	return node;
@@ -55,16 +55,16 @@ static ast_node_t* make_function(buffer_t params, ast_node_t* body)
 	return node;
 }
 
-static ast_node_t* make_identifier(token_t t, identifier_t* id)
+static ast_node_t* make_identifier(token_t t, const char* name)
 {
 	ast_node_t* node = ALLOC(sizeof(ast_node_t));
 	node->type = AST_IDENTIFIER;
 	node->identifier.token = t;
-	node->identifier.id = id;
+	node->identifier.name = name;
 	return node;
 }
 
-static ast_node_t* make_literal(token_type_t type, literal_t* lit)
+static ast_node_t* make_literal(token_type_t type, literal_t lit)
 {
 	ast_node_t* node = ALLOC(sizeof(ast_node_t));
 	node->type = AST_LITERAL;
@@ -73,7 +73,7 @@ static ast_node_t* make_literal(token_type_t type, literal_t* lit)
 	return node;
 }
 
-static ast_node_t* make_property(token_type_t op, ast_node_t* lhs, identifier_t* name)
+static ast_node_t* make_property(token_type_t op, ast_node_t* lhs, const char* name)
 {
 	ast_node_t* node = ALLOC(sizeof(ast_node_t));
 	node->type = AST_PROPERTY;
@@ -6,7 +6,7 @@ static bool parse_parameter_list(vm_t* vm, parser_t* p, buffer_t* parameters)
 
 		token_t t = p->current;
 		if (!must_consume(vm, p, TOKEN_IDENTIFIER, "expected parameter")) return false;
-		buffer_push(parameters, &t);
+		vm_buffer_push(vm, parameters, &t);
 	}
 
 	return true;
@@ -19,7 +19,7 @@ static bool parse_argument_list(vm_t* vm, parser_t* p, buffer_t* arguments)
 
 		ast_node_t* arg = expression(vm, p);
 		if (!arg) return false;
-		buffer_push(arguments, &arg);
+		vm_buffer_push(vm, arguments, &arg);
 	}
 
 	return true;
@@ -61,10 +61,10 @@ static ast_node_t* gr_function(vm_t* vm, parser_t* p)
 	ast_node_t* body = NULL;
 	if (consumes(vm, p, TOKEN_EQUALS_GREATER)) {
 		// Still need to make a block to insert parameters as locals and upvalues
-		body = make_block(p, &params);
+		body = make_block(vm, p, &params);
 		ast_node_t* ret = make_return(expression(vm, p));
 		if (!ret->ret.expression) { FREE(ret); goto fail; }
-		buffer_push(&body->block.body, &ret);
+		vm_buffer_push(vm, &body->block.body, &ret);
 		p->scope = body->block.scope->parent;
 	} else {
 		body = block_statement(vm, p, &params);
@@ -84,12 +84,12 @@ static ast_node_t* gr_identifier(vm_t* vm, parser_t* p)
 	token_t name = consume(vm, p);
 	identifier_t* id = buffer_at(&p->lexer.identifiers, name.index);
 
-	if (scope_find_local_or_upvalue(p->scope, &name) == NOT_FOUND) {
+	if (scope_find_local_or_upvalue(vm, p->scope, &name) == NOT_FOUND) {
 		// parse_error(vm, p, "undefined variable '%s'", id->name);
 		// return NULL;
 	}
 
-	return make_identifier(name, id);
+	return make_identifier(name, id->name);
 }
 
 /*static ast_node_t* gr_index(vm_t* vm, parser_t* p, ast_node_t* lhs)
@@ -112,10 +112,11 @@ static ast_node_t* gr_identifier(vm_t* vm, parser_t* p)
 static ast_node_t* gr_literal(vm_t* vm, parser_t* p)
 {
 	token_t t = consume(vm, p);
-	return make_literal(
-		t.type,
-		(t.type == TOKEN_STRING || t.type == TOKEN_NUMBER) ? buffer_at(&p->lexer.literals, t.index) : NULL
-	);
+	// Copied, the lexer's literals move around as more of them are read
+	literal_t lit = { 0 };
+	if (t.type == TOKEN_STRING || t.type == TOKEN_NUMBER)
+		lit = *(literal_t*)buffer_at(&p->lexer.literals, t.index);
+	return make_literal(t.type, lit);
 }
 
 static ast_node_t* gr_property(vm_t* vm, parser_t* p, ast_node_t* lhs)
@@ -125,7 +126,7 @@ static ast_node_t* gr_property(vm_t* vm, parser_t* p, ast_node_t* lhs)
 	EXPECT(IDENTIFIER, "identifier after '.'");
 	token_t property = p->previous;
 
-	return make_property(op, lhs, buffer_at(&p->lexer.identifiers, property.index));
+	return make_property(op, lhs, ((identifier_t*)buffer_at(&p->lexer.identifiers, property.index))->name);
 }
 
 static ast_node_t* gr_ternary(vm_t* vm, parser_t* p, ast_node_t* condition)
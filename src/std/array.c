@@ -6,23 +6,26 @@ static int8_t array_at(vm_t* vm, uint8_t argc)
 	assert(argc == 1);
 	array_t* this = AS_ARRAY(vm_pop(vm));
 	value_t index = vm_pop(vm);
-	value_t* value = buffer_at(&this->values, AS_NUMBER(index));
-	assert(value);
-	vm_push(vm, value ? *value : VALUE_NULL);
+	size_t i = AS_NUMBER(index);
+	assert(i < this->values.size);
+	vm_push(vm, i < this->values.size ? this->values.data[i] : VALUE_NULL);
 	return 1;
 }
 
 static int8_t array_each(vm_t* vm, uint8_t argc)
 {
 	assert(argc == 1);
-	array_t* this = AS_ARRAY(vm_pop(vm));
-	value_t callback = vm_pop(vm);
+	// Both stay on the stack while the callback runs, it may collect garbage
+	size_t base = vm->sp - vm->stack - 2;
+	array_t* this = AS_ARRAY(vm->sp[-1]);
+	value_t callback = vm->sp[-2];
 	assert(IS_FUNCTION(callback));
 
-	buffer_foreach(this->values, value_t, it) {
-		vm_push(vm, *it);
+	for (size_t i = 0; i < this->values.size; ++i) {
+		vm_push(vm, this->values.data[i]);
 		vm_interpret(vm, callback, 1);
 	}
+	vm->sp = vm->stack + base;
 	return 0;
 }
 
@@ -39,10 +42,11 @@ static int8_t range(vm_t* vm, uint8_t argc)
 	}
 
 	array_t* a = new_array(vm);
-	for (double i = AS_NUMBER(min); i < AS_NUMBER(max); i += AS_NUMBER(step)) {
-		value_t it = VALUE_NUMBER(i);
-		buffer_push(&a->values, &it);
-	}
+	double count = (AS_NUMBER(max) - AS_NUMBER(min)) / AS_NUMBER(step);
+	if (count > 0 && count < SIZE_MAX / sizeof(value_t))
+		array_reserve(vm, a, (size_t)count + 1);
+	for (double i = AS_NUMBER(min); i < AS_NUMBER(max); i += AS_NUMBER(step))
+		array_push(vm, a, VALUE_NUMBER(i));
 
 	vm_push(vm, VALUE_OBJECT(a));
 	return 1;
@@ -55,5 +59,5 @@ void vm_std_array(vm_t* vm)
 	DEFINE_METHOD(vm->array_class, "at", array_at, 1);
 	DEFINE_METHOD(vm->array_class, "each", array_each, 1);
 
-	table_set(vm->global, VALUE_OBJECT(new_string(vm, "range")), VALUE_OBJECT(new_native_function(vm, &range, 2)));
+	vm_define_native(vm, vm->global, "range", &range, 2);
 }
@@ -1,6 +1,6 @@
 #include <assert.h>
 #include <stdio.h>
-#include "vm.h"
+#include "std.h"
 
 static int8_t print(vm_t* vm, uint8_t argc)
 {
@@ -37,6 +37,6 @@ static int8_t println(vm_t* vm, uint8_t argc)
 
 void vm_std_io(vm_t* vm)
 {
-	table_set(vm->global, VALUE_OBJECT(new_string(vm, "print")), VALUE_OBJECT(new_native_function(vm, &print, 1)));
-	table_set(vm->global, VALUE_OBJECT(new_string(vm, "println")), VALUE_OBJECT(new_native_function(vm, &println, 1)));
+	vm_define_native(vm, vm->global, "print", &print, 1);
+	vm_define_native(vm, vm->global, "println", &println, 1);
 }
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <string.h>
 #include "std.h"
 
 static int8_t get(vm_t* vm, uint8_t argc)
@@ -16,14 +17,34 @@ static int8_t set(vm_t* vm, uint8_t argc)
 	table_t* this = AS_TABLE(vm_pop(vm));
 	value_t key = vm_pop(vm);
 	value_t value = vm_pop(vm);
-	table_set(this, key, value);
+	table_set(vm, this, key, value);
 	return 0;
 }
 
+// Makes a table, whose keys and values are weak if its mode, a string, has a
+// "k" or a "v"
+static int8_t table(vm_t* vm, uint8_t argc)
+{
+	table_mode_t mode = TABLE_STRONG;
+	if (argc >= 1) {
+		value_t arg = vm_pop(vm);
+		assert(IS_STRING(arg));
+		if (strchr(AS_STRING(arg)->data, 'k'))
+			mode |= TABLE_WEAK_KEYS;
+		if (strchr(AS_STRING(arg)->data, 'v'))
+			mode |= TABLE_WEAK_VALUES;
+	}
+
+	vm_push(vm, VALUE_OBJECT(new_weak_table(vm, mode)));
+	return 1;
+}
+
 void vm_std_table(vm_t* vm)
 {
 	vm->table_class = new_class(vm, NULL, new_string(vm, "Table"));
 
 	DEFINE_METHOD(vm->table_class, "get", get, 1);
 	DEFINE_METHOD(vm->table_class, "set", set, 2);
+
+	vm_define_native(vm, vm->global, "table", &table, 0);
 }
@@ -20,6 +20,24 @@ void vm_std_all(vm_t* vm)
 	vm->string_class = new_class(vm, NULL, new_string(vm, "String"));
 }
 
+// The name stays on the stack while the function is allocated
+void vm_define_native(vm_t* vm, table_t* table, const char* name, native_fn_t fn, uint8_t arity)
+{
+	vm_push(vm, VALUE_OBJECT(new_string(vm, name)));
+	table_set(vm, table, vm->sp[-1], VALUE_OBJECT(new_native_function(vm, fn, arity)));
+	vm_pop(vm);
+}
+
+static void open_globals(vm_t* vm, void* data)
+{
+	(void)data;
+	vm->global = new_table(vm);
+	vm_pin(vm, VALUE_OBJECT(vm->global));
+	vm->global_slot_index = new_table(vm);
+	vm_pin(vm, VALUE_OBJECT(vm->global_slot_index));
+}
+
+// Returns NULL if it runs out of memory
 vm_t* vm_open(char** environment, error_handler_t error)
 {
 	vm_t* vm = ALLOC(sizeof(vm_t));
@@ -30,26 +48,89 @@ vm_t* vm_open(char** environment, error_handler_t error)
 	vm->environment = environment;
 	vm->error_handler = error;
 
-	vm->heap = NULL;
-	vm->gc_roots = buffer_new(sizeof(object_t*));
-	vm->global = new_table(vm);
-	vm_gc_keep_alive(vm, (object_t*)vm->global);
-	vm_init_string_pool(&vm->string_pool, 32);
+	// Roots must exist before the first allocation
+	vm->stack = ALLOC(STACK_CAPACITY * sizeof(value_t));
+	vm->sp = vm->stack;
+	vm->stack_capacity = STACK_CAPACITY;
+	vm->frames = ALLOC(CALL_STACK_DEPTH * sizeof(frame_t));
+	vm->frame_count = 0;
+	vm->max_frames = CALL_STACK_DEPTH;
+	vm->error_jump = NULL;
+	vm->jit_threshold = JIT_THRESHOLD;
 
-	vm->stack = buffer_new(sizeof(value_t));
+	allocator_init(&vm->allocator, vm_finalize, vm);
+	vm->young = NULL;
+	vm->gc_pins = (pin_vector_t){ 0 };
+	vm->gc_free_pin = SIZE_MAX;
+	vm->gc_handles = (value_vector_t){ 0 };
+	vm->gc_remembered = buffer_new(sizeof(object_t*));
+	vm->gc_remembered_overflow = false;
+	vm->gc_weak_tables = buffer_new(sizeof(table_t*));
+	vm->gc_young_allocated = 0;
+	vm->gc_nursery = GC_NURSERY_SIZE;
+	vm->gc_gray = buffer_new(sizeof(object_t*));
+	vm->gc_gray_overflow = false;
+	vm->gc_allocated = 0;
+	vm->gc_next = vm->gc_threshold = GC_THRESHOLD;
+	vm->gc_buffer_bytes = STACK_CAPACITY * sizeof(value_t);
+	vm->gc_limit = GC_HEAP_LIMIT;
+	vm->gc_step_work = GC_STEP_WORK;
+	vm->gc_phase = GC_IDLE;
+	vm->gc_mark_threads = GC_MARK_THREADS;
+	vm->gc_compact_ratio = GC_COMPACT_RATIO;
+	vm->global_slots = buffer_new(sizeof(global_slot_t));
+	if (!vm->stack || !vm->frames || !vm_init_string_pool(&vm->string_pool, STRING_POOL_CAPACITY)
+		|| !vm_protect(vm, open_globals, NULL)) {
+		vm_destroy(vm);
+		return NULL;
+	}
 
 	return vm;
 }
 
+// Index of the slot holding the global `name`, allocating it on first use
+size_t vm_global_slot(vm_t* vm, value_t name)
+{
+	value_t index = table_get(vm->global_slot_index, name);
+	if (index != VALUE_NULL)
+		return AS_NUMBER(index);
+
+	global_slot_t slot = { name, table_get(vm->global, name), vm->global->version };
+	vm_buffer_push(vm, &vm->global_slots, &slot);
+	table_set(vm, vm->global_slot_index, name, VALUE_NUMBER(vm->global_slots.size - 1));
+	return vm->global_slots.size - 1;
+}
+
+// Can only be changed while no function is running. Reallocating to no
+// frames would free them.
+bool vm_set_max_frames(vm_t* vm, size_t max_frames)
+{
+	if (vm->frame_count > 0 || max_frames == 0)
+		return false;
+
+	frame_t* frames = REALLOC(vm->frames, max_frames * sizeof(frame_t));
+	if (!frames)
+		return false;
+
+	vm->frames = frames;
+	vm->max_frames = max_frames;
+	return true;
+}
+
 void vm_destroy(vm_t* vm)
 {
-	// Free the root object list so we collect ALL objects
-	buffer_free(&vm->gc_roots);
-	// Collect before freeing the heap
-	vm_gc_collect(vm);
-	vm->heap = NULL;
+	// Everything goes, reachable or not
+	pin_vector_free(&vm->gc_pins);
+	value_vector_free(&vm->gc_handles);
+	buffer_free(&vm->gc_gray);
+	buffer_free(&vm->gc_remembered);
+	allocator_destroy(&vm->allocator);
+	vm->young = NULL;
+	buffer_free(&vm->gc_weak_tables);
 
-	buffer_free(&vm->stack);
+	buffer_free(&vm->global_slots);
+	FREE(vm->stack);
+	FREE(vm->frames);
 	vm_free_string_pool(&vm->string_pool);
 
 	FREE(vm);
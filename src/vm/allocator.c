@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "vm/allocator.h"
+
+static const size_t class_sizes[SIZE_CLASS_COUNT] = {
+	16, 32, 48, 64, 80, 96, 112, 128, 192, 256, 384, 512, 768, 1024,
+};
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+#define FIRST_BLOCK(slab) ((uint8_t*)(slab) + SLAB_HEADER_SIZE)
+#define PAGE_SIZE 4096
+
+void allocator_init(allocator_t* allocator, finalizer_t finalize, void* data)
+{
+	memset(allocator, 0, sizeof(*allocator));
+	uint8_t c = 0;
+	for (size_t i = 0; i <= LARGEST_SIZE_CLASS / 16; ++i) {
+		while (class_sizes[c] < i * 16)
+			c++;
+		allocator->class_of[i] = c;
+	}
+	for (c = 0; c < SIZE_CLASS_COUNT; ++c)
+		allocator->classes[c].size = class_sizes[c];
+	allocator->finalize = finalize;
+	allocator->data = data;
+}
+
+static void unlink_slab(slab_t** list, slab_t* slab)
+{
+	if (slab->prev) slab->prev->next = slab->next;
+	else *list = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->prev = slab->next = NULL;
+}
+
+static void link_slab(slab_t** list, slab_t* slab)
+{
+	slab->prev = NULL;
+	slab->next = *list;
+	if (*list) (*list)->prev = slab;
+	*list = slab;
+}
+
+// Moves every slab of `from` to `to`
+static size_t move_slabs(slab_t** from, slab_t** to)
+{
+	size_t count = 0;
+	while (*from) {
+		slab_t* slab = *from;
+		unlink_slab(from, slab);
+		link_slab(to, slab);
+		count++;
+	}
+	return count;
+}
+
+// Map `size` bytes aligned on SLAB_SIZE, cut out of a larger mapping
+static slab_t* map_slab(size_t size)
+{
+	uint8_t* mapped = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapped == MAP_FAILED)
+		return NULL;
+
+	uint8_t* start = (uint8_t*)(((uintptr_t)mapped + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+	if (start > mapped)
+		munmap(mapped, start - mapped);
+	munmap(start + size, mapped + SLAB_SIZE - start);
+
+	slab_t* slab = (slab_t*)start;
+	slab->end = start + size;
+	return slab;
+}
+
+static void unmap_slab(slab_t* slab)
+{
+	munmap(slab, slab->end - (uint8_t*)slab);
+}
+
+static slab_t* new_slab(size_class_t* class)
+{
+	slab_t* slab = map_slab(SLAB_SIZE);
+	if (!slab)
+		return NULL;
+	slab->class = class;
+	slab->bump = FIRST_BLOCK(slab);
+	class->slabs++;
+	link_slab(&class->partial, slab);
+	return slab;
+}
+
+static void finalize_slabs(allocator_t* allocator, slab_t* slab)
+{
+	while (slab) {
+		slab_t* next = slab->next;
+		for (size_t w = 0; w < SLAB_BITMAP_WORDS && allocator->finalize; ++w) {
+			for (uint64_t live = slab->live[w]; live; live &= live - 1)
+				allocator->finalize(allocator->data, (uint8_t*)slab + (w * 64 + __builtin_ctzll(live)) * SLAB_GRANULE);
+		}
+		unmap_slab(slab);
+		slab = next;
+	}
+}
+
+void allocator_destroy(allocator_t* allocator)
+{
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		size_class_t* class = &allocator->classes[c];
+		finalize_slabs(allocator, class->partial);
+		finalize_slabs(allocator, class->full);
+		finalize_slabs(allocator, class->unswept);
+		class->partial = class->full = class->unswept = NULL;
+		class->slabs = 0;
+	}
+	finalize_slabs(allocator, allocator->large);
+	finalize_slabs(allocator, allocator->large_unswept);
+	allocator->large = allocator->large_unswept = NULL;
+	allocator->unswept = 0;
+}
+
+static void clear_marks(slab_t* slab)
+{
+	for (; slab; slab = slab->next)
+		memset(slab->marks, 0, sizeof(slab->marks));
+}
+
+void allocator_clear_marks(allocator_t* allocator)
+{
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		clear_marks(allocator->classes[c].partial);
+		clear_marks(allocator->classes[c].full);
+		clear_marks(allocator->classes[c].unswept);
+	}
+	clear_marks(allocator->large);
+	clear_marks(allocator->large_unswept);
+}
+
+static inline bool slab_is_full(slab_t* slab)
+{
+	return !slab->free && slab->bump + slab->class->size > slab->end;
+}
+
+// Keep the last slab of a class around, a single object being allocated and
+// freed over and over would map and unmap it every time
+static inline bool should_release(slab_t* slab)
+{
+	return slab->used == 0 && slab->class->slabs > 1;
+}
+
+// Frees the unmarked blocks a word of the bitmaps at a time, the others are
+// old from now on. Returns the blocks looked at.
+static size_t sweep_slab(allocator_t* allocator, slab_t* slab)
+{
+	size_class_t* class = slab->class;
+	size_t work = 0;
+	for (size_t w = 0; w < SLAB_BITMAP_WORDS; ++w) {
+		if (!slab->live[w])
+			continue;
+		work += __builtin_popcountll(slab->live[w]);
+		for (uint64_t dead = slab->live[w] & ~slab->marks[w]; dead; dead &= dead - 1) {
+			void* block = (uint8_t*)slab + (w * 64 + __builtin_ctzll(dead)) * SLAB_GRANULE;
+			allocator->finalize(allocator->data, block);
+			*(void**)block = slab->free;
+			slab->free = block;
+			slab->used--;
+			class->frees++;
+		}
+		slab->live[w] &= slab->marks[w];
+		slab->old[w] = slab->live[w];
+	}
+
+	allocator->unswept--;
+	if (should_release(slab)) {
+		unmap_slab(slab);
+		class->slabs--;
+	} else {
+		link_slab(slab_is_full(slab) ? &class->full : &class->partial, slab);
+	}
+	return work;
+}
+
+static void sweep_large(allocator_t* allocator, slab_t* slab)
+{
+	void* block = FIRST_BLOCK(slab);
+	allocator->unswept--;
+	if (!allocator_is_marked(block)) {
+		allocator->finalize(allocator->data, block);
+		unmap_slab(slab);
+		allocator->large_frees++;
+	} else {
+		allocator_set_old(block);
+		link_slab(&allocator->large, slab);
+	}
+}
+
+void allocator_start_sweep(allocator_t* allocator)
+{
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		size_class_t* class = &allocator->classes[c];
+		allocator->unswept += move_slabs(&class->partial, &class->unswept);
+		allocator->unswept += move_slabs(&class->full, &class->unswept);
+	}
+	allocator->unswept += move_slabs(&allocator->large, &allocator->large_unswept);
+}
+
+size_t allocator_sweep(allocator_t* allocator, size_t budget)
+{
+	size_t work = 0;
+	for (size_t c = 0; c < SIZE_CLASS_COUNT && work < budget; ++c) {
+		size_class_t* class = &allocator->classes[c];
+		while (class->unswept && work < budget) {
+			slab_t* slab = class->unswept;
+			unlink_slab(&class->unswept, slab);
+			// Empty slabs count too, so that sweeping always gets somewhere
+			work += sweep_slab(allocator, slab) + 1;
+		}
+	}
+	while (allocator->large_unswept && work < budget) {
+		slab_t* slab = allocator->large_unswept;
+		unlink_slab(&allocator->large_unswept, slab);
+		sweep_large(allocator, slab);
+		work++;
+	}
+	return work;
+}
+
+// From the first slab with free blocks, there must be one
+static void* take_block(size_class_t* class)
+{
+	slab_t* slab = class->partial;
+	void* block;
+	if (slab->free) {
+		block = slab->free;
+		slab->free = *(void**)block;
+	} else {
+		block = slab->bump;
+		slab->bump += class->size;
+	}
+	slab->used++;
+
+	if (slab_is_full(slab)) {
+		unlink_slab(&class->partial, slab);
+		link_slab(&class->full, slab);
+	}
+	GRANULE_WORD(live, block) |= GRANULE_BIT(block);
+	return block;
+}
+
+void* allocator_alloc(allocator_t* allocator, size_t size)
+{
+	if (size > LARGEST_SIZE_CLASS) {
+		slab_t* slab = map_slab((SLAB_HEADER_SIZE + size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1));
+		if (!slab)
+			return NULL;
+		slab->used = 1;
+		link_slab(&allocator->large, slab);
+		allocator->large_allocations++;
+		uint8_t* block = FIRST_BLOCK(slab);
+		GRANULE_WORD(live, block) |= GRANULE_BIT(block);
+		return block;
+	}
+
+	size_class_t* class = &allocator->classes[allocator->class_of[(size + 15) / 16]];
+	// Blocks are only handed out from swept slabs
+	while (!class->partial && class->unswept) {
+		slab_t* slab = class->unswept;
+		unlink_slab(&class->unswept, slab);
+		sweep_slab(allocator, slab);
+	}
+	if (!class->partial && !new_slab(class))
+		return NULL;
+
+	void* block = take_block(class);
+	class->allocations++;
+	memset(block, 0, size);
+	GRANULE_WORD(marks, block) &= ~GRANULE_BIT(block);
+	GRANULE_WORD(old, block) &= ~GRANULE_BIT(block);
+	return block;
+}
+
+void allocator_free(allocator_t* allocator, void* ptr, size_t size)
+{
+	slab_t* slab = slab_of(ptr);
+	if (size > LARGEST_SIZE_CLASS) {
+		unlink_slab(&allocator->large, slab);
+		unmap_slab(slab);
+		allocator->large_frees++;
+		return;
+	}
+
+	size_class_t* class = slab->class;
+	if (slab_is_full(slab)) {
+		unlink_slab(&class->full, slab);
+		link_slab(&class->partial, slab);
+	}
+
+	GRANULE_WORD(live, ptr) &= ~GRANULE_BIT(ptr);
+	*(void**)ptr = slab->free;
+	slab->free = ptr;
+	slab->used--;
+	class->frees++;
+
+	if (should_release(slab)) {
+		unlink_slab(&class->partial, slab);
+		unmap_slab(slab);
+		class->slabs--;
+	}
+}
+
+static void foreach_block(slab_t* slab, finalizer_t fn, void* data)
+{
+	for (; slab; slab = slab->next) {
+		for (size_t w = 0; w < SLAB_BITMAP_WORDS; ++w) {
+			for (uint64_t live = slab->live[w]; live; live &= live - 1)
+				fn(data, (uint8_t*)slab + (w * 64 + __builtin_ctzll(live)) * SLAB_GRANULE);
+		}
+	}
+}
+
+void allocator_foreach(allocator_t* allocator, finalizer_t fn, void* data)
+{
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		foreach_block(allocator->classes[c].partial, fn, data);
+		foreach_block(allocator->classes[c].full, fn, data);
+		foreach_block(allocator->classes[c].unswept, fn, data);
+	}
+	foreach_block(allocator->large, fn, data);
+	foreach_block(allocator->large_unswept, fn, data);
+}
+
+// Slabs the blocks of `class` fit in, one is always kept
+static size_t needed_slabs(size_class_t* class)
+{
+	size_t used = 0;
+	for (slab_t* slab = class->partial; slab; slab = slab->next)
+		used += slab->used;
+	for (slab_t* slab = class->full; slab; slab = slab->next)
+		used += slab->used;
+	size_t capacity = (SLAB_SIZE - SLAB_HEADER_SIZE) / class->size;
+	size_t needed = (used + capacity - 1) / capacity;
+	return needed > 0 ? needed : 1;
+}
+
+unsigned allocator_fragmentation(allocator_t* allocator)
+{
+	size_t slabs = 0, spare = 0;
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c) {
+		size_class_t* class = &allocator->classes[c];
+		if (class->unswept)
+			continue;
+		slabs += class->slabs;
+		spare += class->slabs - needed_slabs(class);
+	}
+	return slabs > 0 ? spare * 100 / slabs : 0;
+}
+
+static int by_use(const void* a, const void* b)
+{
+	uint32_t used_a = (*(slab_t**)a)->used, used_b = (*(slab_t**)b)->used;
+	return used_a < used_b ? 1 : used_a > used_b ? -1 : 0;
+}
+
+// Keeps the fullest slabs of `class` and empties the others into them
+static size_t evacuate_class(allocator_t* allocator, size_class_t* class)
+{
+	size_t needed = needed_slabs(class);
+	if (class->unswept || class->slabs <= needed)
+		return 0;
+
+	// The class is left as it is when memory is short
+	slab_t** slabs = ALLOC(class->slabs * sizeof(slab_t*));
+	if (!slabs)
+		return 0;
+	size_t count = 0;
+	for (slab_t* slab = class->partial; slab; slab = slab->next)
+		slabs[count++] = slab;
+	for (slab_t* slab = class->full; slab; slab = slab->next)
+		slabs[count++] = slab;
+	qsort(slabs, count, sizeof(slab_t*), by_use);
+
+	// Only the slabs kept are left to take blocks from
+	for (size_t i = needed; i < count; ++i) {
+		unlink_slab(slab_is_full(slabs[i]) ? &class->full : &class->partial, slabs[i]);
+		slabs[i]->evacuated = true;
+		link_slab(&allocator->evacuated, slabs[i]);
+	}
+
+	for (size_t i = needed; i < count; ++i) {
+		slab_t* slab = slabs[i];
+		for (size_t w = 0; w < SLAB_BITMAP_WORDS; ++w) {
+			for (uint64_t live = slab->live[w]; live; live &= live - 1) {
+				uint8_t* from = (uint8_t*)slab + (w * 64 + __builtin_ctzll(live)) * SLAB_GRANULE;
+				void* to = take_block(class);
+				memcpy(to, from, class->size);
+				GRANULE_WORD(old, to) &= ~GRANULE_BIT(to);
+				if (allocator_is_old(from))
+					allocator_set_old(to);
+				*(void**)from = to;
+			}
+		}
+	}
+
+	FREE(slabs);
+	return count - needed;
+}
+
+size_t allocator_evacuate(allocator_t* allocator)
+{
+	size_t evacuated = 0;
+	for (size_t c = 0; c < SIZE_CLASS_COUNT; ++c)
+		evacuated += evacuate_class(allocator, &allocator->classes[c]);
+	return evacuated;
+}
+
+void allocator_release_evacuated(allocator_t* allocator)
+{
+	while (allocator->evacuated) {
+		slab_t* slab = allocator->evacuated;
+		unlink_slab(&allocator->evacuated, slab);
+		slab->class->slabs--;
+		unmap_slab(slab);
+	}
+}
@@ -16,8 +16,12 @@ static uint32_t fnv1_hash_data(const void *data, size_t size)
 	return hash;
 }
 
+// Marks removed entries, it is never dereferenced
+static string_t tombstone;
+#define TOMBSTONE (&tombstone)
+
 static inline bool should_rehash(string_pool_t* sp) {
-	return (sp->count + 1) * 100 >= sp->capacity * HASH_LOAD_FACTOR;
+	return (sp->count + sp->tombstones + 1) * 100 >= sp->capacity * HASH_LOAD_FACTOR;
 }
 
 static uint32_t double_hash(uint32_t h)
@@ -33,16 +37,19 @@ static uint32_t double_hash(uint32_t h)
 	return h;
 }
 
-static void rehash(string_pool_t* sp, size_t new_capacity)
+// Tombstones are dropped on the way, returns false if it could not allocate
+static bool rehash(string_pool_t* sp, size_t new_capacity)
 {
 	if (new_capacity < sp->capacity)
-		return;
+		return true;
 
 	string_t** new_buckets = ALLOC(new_capacity * sizeof(string_t*));
+	if (!new_buckets)
+		return false;
 
 	for (size_t i = 0; i < sp->capacity; ++i) {
 		string_t** b = sp->buckets + i;
-		if (*b != NULL) {
+		if (*b != NULL && *b != TOMBSTONE) {
 			uint32_t h = (*b)->hash;
 			for (;;) {
 				uint32_t index = h % new_capacity;
@@ -59,53 +66,76 @@ static void rehash(string_pool_t* sp, size_t new_capacity)
 	FREE(sp->buckets);
 	sp->buckets = new_buckets;
 	sp->capacity = new_capacity;
+	sp->tombstones = 0;
+	return true;
 }
 
-void vm_init_string_pool(string_pool_t* sp, size_t capacity)
+// Returns false if it could not allocate
+bool vm_init_string_pool(string_pool_t* sp, size_t capacity)
 {
 	sp->capacity = capacity;
 	sp->count = 0;
+	sp->tombstones = 0;
 	sp->buckets = ALLOC(capacity * sizeof(string_t*));
+	return sp->buckets != NULL;
 }
 
 void vm_free_string_pool(string_pool_t* sp)
 {
 	sp->capacity = 0;
 	sp->count = 0;
+	sp->tombstones = 0;
 	FREE(sp->buckets);
 }
 
-string_t** vm_lookup_string_pool(string_pool_t* sp, const char* str, size_t length)
+// Returns the pooled string equal to `str`, or NULL
+string_t* vm_lookup_string_pool(string_pool_t* sp, const char* str, size_t length)
 {
-	uint32_t str_hash = fnv1_hash_data(str, length);
+	uint32_t h = fnv1_hash_data(str, length);
+	for (;;) {
+		string_t* string = sp->buckets[h % sp->capacity];
+		if (string == NULL)
+			return NULL;
+		if (string != TOMBSTONE && string->length == length && memcmp(string->data, str, length) == 0)
+			return string;
 
-	if (should_rehash(sp)) {
-		rehash(sp, sp->capacity * 2);
+		uint32_t g = double_hash(h);
+		assert(g != h);
+		h = g;
 	}
+}
 
-	uint32_t h = str_hash;
-	for (;;) {
-		uint32_t index = h % sp->capacity;
-		string_t** bucket = sp->buckets + index;
+// Makes room for one more string, returns false if the pool could not grow.
+// Removing strings keeps the room made.
+bool vm_string_pool_reserve(string_pool_t* sp)
+{
+	// Only grow when the pool is mostly made of live strings, otherwise
+	// clearing the tombstones makes enough room
+	if (!should_rehash(sp))
+		return true;
+	return rehash(sp, (sp->count + 1) * 100 >= sp->capacity * HASH_LOAD_FACTOR / 2 ? sp->capacity * 2 : sp->capacity);
+}
 
-		// Bucket is free
-		if (*bucket == NULL) {
-			*bucket = ALLOC(sizeof(string_t) + length + 1);
-			(*bucket)->hash = str_hash;
+// Adds a string that is not in the pool yet, computing its hash. Room must have
+// been made for it with `vm_string_pool_reserve`.
+void vm_string_pool_insert(string_pool_t* sp, string_t* string)
+{
+	string->hash = fnv1_hash_data(string->data, string->length);
+	uint32_t h = string->hash;
+	for (;;) {
+		string_t** bucket = sp->buckets + h % sp->capacity;
+		if (*bucket == NULL || *bucket == TOMBSTONE) {
+			if (*bucket == TOMBSTONE)
+				sp->tombstones--;
+			*bucket = string;
 			sp->count++;
-			return bucket;
-		}
-		// Bucket is allocated (= in use)
-		if ((*bucket)->hash == str_hash && strncmp((*bucket)->data, str, length) == 0) {
-			return bucket;
+			return;
 		}
 
 		uint32_t g = double_hash(h);
 		assert(g != h);
 		h = g;
 	}
-
-	return NULL;
 }
 
 void vm_string_pool_remove(string_pool_t* sp, string_t* string)
@@ -117,8 +147,9 @@ void vm_string_pool_remove(string_pool_t* sp, string_t* string)
 
 		// `string_t` pointers should be unique, thus we can strictly compare them
 		if (*bucket == string) {
-			*bucket = NULL;
+			*bucket = TOMBSTONE;
 			sp->count--;
+			sp->tombstones++;
 			// Deallocation occurs in the GC
 			return;
 		}
@@ -126,3 +157,12 @@ void vm_string_pool_remove(string_pool_t* sp, string_t* string)
 		hash = double_hash(hash);
 	}
 }
+
+// Compaction moved strings, their hashes are still the same
+void vm_string_pool_forward(string_pool_t* sp)
+{
+	for (size_t i = 0; i < sp->capacity; ++i) {
+		if (sp->buckets[i] && sp->buckets[i] != TOMBSTONE)
+			sp->buckets[i] = allocator_forward(sp->buckets[i]);
+	}
+}